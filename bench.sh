@@ -0,0 +1,82 @@
+#!/bin/bash
+# Sends files of each size in $SIZES over each link profile in $PROFILES,
+# with rdpl between rdps and rdpr on loopback, and appends a line per run to
+# the CSV file given (bench.csv by default). Runs are keyed by the commit, so
+# results from different versions can sit in one file and be compared.
+#
+#   SIZES     file sizes in bytes
+#   PROFILES  name=rdpl options, separated by semicolons
+#   RUNS      runs of each size and profile, each with its own seed
+#   SEED      seed of the first run
+#   TIMEOUT   seconds before a run counts as failed
+#   SENDER_ARGS, RECEIVER_ARGS  extra options for rdps and rdpr
+
+OUT=${1:-bench.csv}
+SIZES=${SIZES:-"100000 1000000 10000000"}
+PROFILES=${PROFILES:-"clean=;lossy=-l 0.01 -d 5;wan=-d 25 -j 5 -b 50000;reorder=-d 5 -j 2 -r 0.05;duplicate=-d 2 -D 0.02;harsh=-l 0.03 -d 20 -j 10 -r 0.02 -D 0.01 -b 20000"}
+RUNS=${RUNS:-1}
+SEED=${SEED:-1}
+TIMEOUT=${TIMEOUT:-120}
+RECEIVER_PORT=9301
+RELAY_PORT=9302
+SENDER_PORT=9303
+# rdps never resends a SYN or FIN, so packets no bigger than a bare header
+# are never lost or the run would hang rather than measure anything
+MIN_LOSS_SIZE=21
+
+cd "$(dirname "$0")"
+VERSION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+WORK=$(mktemp -d)
+trap '[ -n "$KEEP" ] || rm -rf "$WORK"' EXIT
+
+if [ ! -s "$OUT" ]; then
+    echo "version,profile,size,run,seed,ok,seconds,goodput_mbps,retransmit_ratio,rto_fires,sender_cpu_s,receiver_cpu_s" > "$OUT"
+fi
+
+# the value of a top level number in a JSON line
+field() {
+    sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p" | tail -n 1
+}
+
+IFS=';' read -ra PROFILE_LIST <<< "$PROFILES"
+for size in $SIZES; do
+    head -c "$size" /dev/urandom > "$WORK/in"
+    for profile in "${PROFILE_LIST[@]}"; do
+        name=${profile%%=*}
+        options=${profile#*=}
+        for run in $(seq 1 "$RUNS"); do
+            seed=$((SEED + run - 1))
+            rm -f "$WORK/out"
+            ./rdpl $options -m $MIN_LOSS_SIZE -s $seed $RELAY_PORT 127.0.0.1 $RECEIVER_PORT > "$WORK/relay.log" 2>&1 &
+            relay=$!
+            TIMEFORMAT='%U %S'
+            { time timeout "$TIMEOUT" ./rdpr -v 0 $RECEIVER_ARGS 127.0.0.1 $RECEIVER_PORT "$WORK/out" > "$WORK/r.log" 2>&1 ; } 2> "$WORK/r.time" &
+            receiver=$!
+            sleep 0.2
+            start=$(date +%s.%N)
+            # -j only matters for the JSON line printed at exit
+            { time timeout "$TIMEOUT" ./rdps -v 0 -j 3600 $SENDER_ARGS 127.0.0.1 $SENDER_PORT 127.0.0.1 $RELAY_PORT "$WORK/in" > "$WORK/s.log" 2> "$WORK/s.json" ; } 2> "$WORK/s.time"
+            sender_rc=$?
+            end=$(date +%s.%N)
+            wait $receiver
+            kill $relay 2>/dev/null
+            wait $relay 2>/dev/null
+
+            ok=0
+            if [ $sender_rc -eq 0 ] && cmp -s "$WORK/in" "$WORK/out"; then
+                ok=1
+            fi
+            retransmitted=$(field retransmitted_bytes < "$WORK/s.json")
+            rto_fires=$(field rto_fires < "$WORK/s.json")
+            read -r s_user s_sys < "$WORK/s.time"
+            read -r r_user r_sys < "$WORK/r.time"
+            awk -v version="$VERSION" -v name="$name" -v size="$size" -v run="$run" -v seed="$seed" -v ok="$ok" \
+                -v start="$start" -v end="$end" -v retransmitted="${retransmitted:-0}" -v rto_fires="${rto_fires:-0}" \
+                -v s_user="$s_user" -v s_sys="$s_sys" -v r_user="$r_user" -v r_sys="$r_sys" 'BEGIN {
+                    seconds = end - start
+                    printf "%s,%s,%d,%d,%d,%d,%.3f,%.3f,%.4f,%d,%.3f,%.3f\n", version, name, size, run, seed, ok,
+                        seconds, size * 8 / seconds / 1000000, retransmitted / size, rto_fires, s_user + s_sys, r_user + r_sys
+                }' | tee -a "$OUT"
+        done
+    done
+done
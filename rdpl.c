@@ -0,0 +1,377 @@
+
+
+// a UDP relay that stands in for a bad network link between rdps and rdpr on
+// one host. Every client of the listening port gets a socket of its own
+// towards the target, so replies find their way back, and both directions go
+// through the same impairments. All the randomness comes from -s, so a run
+// with the same seed and the same packets makes the same decisions
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef unsigned char uint8;
+typedef char int8;
+typedef unsigned short uint16;
+typedef short int16;
+typedef unsigned int uint32;
+typedef int int32;
+typedef unsigned long long uint64;
+typedef long long int64;
+
+#define PACKET_BUFFER_LENGTH (65535 + 256)
+#define MAX_CLIENTS 64
+// packets waiting out their delay, across both directions
+#define MAX_QUEUED 65536
+#define DEFAULT_QUEUE_BYTES (256 * 1024)
+// socket buffers big enough that only the relay decides what is lost
+#define SOCKET_BUFFER (8 * 1024 * 1024)
+
+// the link, set from the command line
+double loss;
+uint64 delay;
+uint64 jitter;
+double reorder;
+double duplicate;
+// bits per second, 0 for no limit
+uint64 bandwidth;
+uint64 queue_bytes;
+// shorter packets are never lost
+int32 min_loss_size;
+
+typedef struct direction {
+    uint64 random_state;
+    // when the link is done sending what it already has queued
+    uint64 link_free;
+    // release time of the last packet sent in order, jitter never puts a
+    // packet ahead of it
+    uint64 last_release;
+    uint64 received;
+    uint64 dropped;
+    uint64 queue_drops;
+    uint64 duplicated;
+    uint64 reordered;
+} direction_t;
+
+typedef struct client {
+    struct sockaddr_in addr;
+    int sock;
+    direction_t to_target;
+    direction_t to_client;
+} client_t;
+
+typedef struct queued {
+    uint64 release;
+    // keeps packets released at the same time in the order they came in
+    uint64 order;
+    int sock;
+    struct sockaddr_in to;
+    uint8 *data;
+    int32 len;
+} queued_t;
+
+int listen_sock;
+struct sockaddr_in target;
+client_t clients[MAX_CLIENTS];
+int32 client_count;
+queued_t queue[MAX_QUEUED];
+int32 queue_length;
+uint64 queue_order;
+uint64 seed;
+volatile sig_atomic_t stopping;
+
+uint64 getCurrentTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)(ts.tv_sec) * 1000000000 + (uint64)(ts.tv_nsec);
+}
+
+// xorshift64*, each direction of each client has a stream of its own so
+// one flow's packets don't change the decisions made for another's
+double nextRandom(direction_t *d) {
+    d->random_state ^= d->random_state >> 12;
+    d->random_state ^= d->random_state << 25;
+    d->random_state ^= d->random_state >> 27;
+    return ((d->random_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void seedDirection(direction_t *d, uint64 stream) {
+    memset(d, 0, sizeof(direction_t));
+    // splitmix64 of the seed and stream, never zero
+    uint64 z = seed + stream * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    d->random_state = (z ^ (z >> 31)) | 1;
+}
+
+int32 queueBefore(queued_t *a, queued_t *b) {
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+void queuePush(queued_t *q) {
+    int32 i = queue_length++;
+    queue[i] = *q;
+    while(i > 0 && queueBefore(&queue[i], &queue[(i - 1) / 2])) {
+        queued_t tmp = queue[i];
+        queue[i] = queue[(i - 1) / 2];
+        queue[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+void queuePop() {
+    queue[0] = queue[--queue_length];
+    int32 i = 0;
+    while(1) {
+        int32 smallest = i;
+        int32 left = 2 * i + 1;
+        int32 right = 2 * i + 2;
+        if(left < queue_length && queueBefore(&queue[left], &queue[smallest])) {
+            smallest = left;
+        }
+        if(right < queue_length && queueBefore(&queue[right], &queue[smallest])) {
+            smallest = right;
+        }
+        if(smallest == i) {
+            break;
+        }
+        queued_t tmp = queue[i];
+        queue[i] = queue[smallest];
+        queue[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// works out when a packet comes out of the far end of the link and queues it
+void schedule(direction_t *d, int sock, struct sockaddr_in *to, uint8 *data, int32 len, uint64 now) {
+    if(queue_length == MAX_QUEUED) {
+        d->queue_drops++;
+        return;
+    }
+    uint64 sent = now;
+    if(bandwidth > 0) {
+        // the packet waits for the ones ahead of it to be serialised, and is
+        // dropped if that queue is already full
+        uint64 start = d->link_free > now ? d->link_free : now;
+        if((start - now) * bandwidth / 8000000000ULL > queue_bytes) {
+            d->queue_drops++;
+            return;
+        }
+        d->link_free = start + (uint64) len * 8000000000ULL / bandwidth;
+        sent = d->link_free;
+    }
+    uint64 release = sent + delay;
+    if(jitter > 0) {
+        int64 offset = (int64)(nextRandom(d) * (2 * jitter + 1)) - (int64) jitter;
+        release = offset < 0 && (uint64)(-offset) > release ? 0 : release + offset;
+    }
+    if(reorder > 0 && nextRandom(d) < reorder) {
+        // skips the delay, so overtakes whatever is on the way
+        release = sent;
+        d->reordered++;
+    } else {
+        if(release < d->last_release) {
+            release = d->last_release;
+        }
+        d->last_release = release;
+    }
+    queued_t q;
+    q.release = release;
+    q.order = queue_order++;
+    q.sock = sock;
+    q.to = *to;
+    q.len = len;
+    q.data = (uint8*) malloc(len);
+    if(q.data == NULL) {
+        fprintf(stderr, "Failed to allocate a queued packet\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(q.data, data, len);
+    queuePush(&q);
+}
+
+void impair(direction_t *d, int sock, struct sockaddr_in *to, uint8 *data, int32 len) {
+    uint64 now = getCurrentTime();
+    if(len >= min_loss_size && loss > 0 && nextRandom(d) < loss) {
+        d->dropped++;
+        return;
+    }
+    schedule(d, sock, to, data, len, now);
+    if(duplicate > 0 && nextRandom(d) < duplicate) {
+        d->duplicated++;
+        schedule(d, sock, to, data, len, now);
+    }
+}
+
+// sends everything whose time has come
+void release() {
+    uint64 now = getCurrentTime();
+    while(queue_length > 0 && queue[0].release <= now) {
+        queued_t *q = &queue[0];
+        if(sendto(q->sock, q->data, q->len, 0, (struct sockaddr*) &q->to, sizeof q->to) < 0 && errno != ENOBUFS && errno != ECONNREFUSED) {
+            fprintf(stderr, "Error relaying packet: %s\n", strerror(errno));
+        }
+        free(q->data);
+        queuePop();
+    }
+}
+
+client_t *findClient(struct sockaddr_in *addr) {
+    int32 i;
+    for(i = 0; i < client_count; i++) {
+        if(clients[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && clients[i].addr.sin_port == addr->sin_port) {
+            return &clients[i];
+        }
+    }
+    if(client_count == MAX_CLIENTS) {
+        return NULL;
+    }
+    client_t *c = &clients[client_count];
+    c->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(c->sock < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return NULL;
+    }
+    int32 size = SOCKET_BUFFER;
+    setsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    memcpy(&c->addr, addr, sizeof(struct sockaddr_in));
+    seedDirection(&c->to_target, 2 * client_count);
+    seedDirection(&c->to_client, 2 * client_count + 1);
+    client_count++;
+    printf("Relaying %s:%d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    return c;
+}
+
+void printDirection(char *name, direction_t *d) {
+    printf("  %s: %llu received, %llu lost, %llu dropped by the queue, %llu duplicated, %llu reordered\n",
+        name, d->received, d->dropped, d->queue_drops, d->duplicated, d->reordered);
+}
+
+void printStats() {
+    int32 i;
+    for(i = 0; i < client_count; i++) {
+        printf("%s:%d\n", inet_ntoa(clients[i].addr.sin_addr), ntohs(clients[i].addr.sin_port));
+        printDirection("to target", &clients[i].to_target);
+        printDirection("to client", &clients[i].to_client);
+    }
+}
+
+void stop(int sig) {
+    stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+    queue_bytes = DEFAULT_QUEUE_BYTES;
+    seed = 1;
+    int32 opt;
+    while((opt = getopt(argc, argv, "b:d:D:j:l:m:q:r:s:")) != -1) {
+        if(opt == 'l') {
+            loss = atof(optarg);
+        } else if(opt == 'd') {
+            delay = atof(optarg) * 1000000;
+        } else if(opt == 'j') {
+            jitter = atof(optarg) * 1000000;
+        } else if(opt == 'r') {
+            reorder = atof(optarg);
+        } else if(opt == 'D') {
+            duplicate = atof(optarg);
+        } else if(opt == 'b') {
+            bandwidth = atof(optarg) * 1000;
+        } else if(opt == 'q') {
+            queue_bytes = atoll(optarg);
+        } else if(opt == 'm') {
+            min_loss_size = atoi(optarg);
+        } else if(opt == 's') {
+            seed = strtoull(optarg, NULL, 10);
+        } else {
+            argc = 0;
+        }
+    }
+    if(argc - optind != 3) {
+        printf("Usage: ./rdpl [-l loss] [-d delay_ms] [-j jitter_ms] [-r reorder] [-D duplicate] [-b kbit/s [-q queue_bytes]] [-m min_loss_size] [-s seed] <listen_port> <target_ip> <target_port>\n");
+        return 0;
+    }
+    argv += optind;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sa.sin_port = htons(atoi(argv[0]));
+    memset(&target, 0, sizeof target);
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = inet_addr(argv[1]);
+    target.sin_port = htons(atoi(argv[2]));
+
+    listen_sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(listen_sock < 0 || bind(listen_sock, (struct sockaddr*) &sa, sizeof sa) != 0) {
+        fprintf(stderr, "Failed to bind port: %s\n", strerror(errno));
+        return 1;
+    }
+    int32 size = SOCKET_BUFFER;
+    setsockopt(listen_sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    printf("Relaying port %s to %s:%s, loss %g delay %llums jitter %llums reorder %g duplicate %g bandwidth %llukbit/s seed %llu\n",
+        argv[0], argv[1], argv[2], loss, delay / 1000000, jitter / 1000000, reorder, duplicate, bandwidth / 1000, seed);
+    fflush(stdout);
+    signal(SIGTERM, stop);
+    signal(SIGINT, stop);
+
+    uint8 buffer[PACKET_BUFFER_LENGTH];
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while(!stopping) {
+        int timeout = -1;
+        if(queue_length > 0) {
+            uint64 now = getCurrentTime();
+            timeout = queue[0].release > now ? (queue[0].release - now + 999999) / 1000000 : 0;
+        }
+        fds[0].fd = listen_sock;
+        fds[0].events = POLLIN;
+        int32 i;
+        for(i = 0; i < client_count; i++) {
+            fds[i + 1].fd = clients[i].sock;
+            fds[i + 1].events = POLLIN;
+        }
+        int32 ready = poll(fds, client_count + 1, timeout);
+        if(ready < 0 && errno != EINTR) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            return 1;
+        }
+        int32 polled = client_count;
+        for(i = 0; ready > 0 && i <= polled; i++) {
+            if(!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            // drain the socket before going back to poll
+            while(1) {
+                struct sockaddr_in from;
+                socklen_t fromlen = sizeof from;
+                int32 len = recvfrom(fds[i].fd, buffer, sizeof buffer, MSG_DONTWAIT, (struct sockaddr*) &from, &fromlen);
+                if(len < 0) {
+                    break;
+                }
+                if(i == 0) {
+                    client_t *c = findClient(&from);
+                    if(c != NULL) {
+                        c->to_target.received++;
+                        impair(&c->to_target, c->sock, &target, buffer, len);
+                    }
+                } else {
+                    client_t *c = &clients[i - 1];
+                    c->to_client.received++;
+                    impair(&c->to_client, listen_sock, &c->addr, buffer, len);
+                }
+            }
+        }
+        release();
+    }
+    printStats();
+    return 0;
+}
@@ -1,17 +1,34 @@
-
+// for sendmmsg and recvmmsg
+#define _GNU_SOURCE
 #include <errno.h>
+#include <linux/filter.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // guarenteed larger than the largest possible packet
-#define PACKET_BUFFER_LENGTH 65535 + 256
+#define PACKET_BUFFER_LENGTH (65535 + 256)
 
 typedef unsigned char uint8;
 typedef char int8;
@@ -19,22 +36,106 @@ typedef unsigned short uint16;
 typedef short int16;
 typedef unsigned int uint32;
 typedef int int32;
+typedef unsigned long long uint64;
+typedef long long int64;
 
 #define TYPE_DAT 1
 #define TYPE_ACK 2
 #define TYPE_SYN 4
 #define TYPE_FIN 8
 #define TYPE_RST 16
+#define TYPE_SACK 32
+#define TYPE_PRB 64
+#define TYPE_FEC 128
+
+// every packet starts with HEADER_LENGTH bytes in network byte order, then
+// the options and then the payload:
+//
+//    0  version    1  type    2  options length / 4    3  unused
+//    4  sequence number
+//    8  ack number
+//   12  window size
+//   16  payload size          18  unused
+//
+// An option is a kind byte, a length byte counting the kind, the length and
+// the data, then the data. They are padded with OPTION_END to a multiple of
+// 4 and kinds a peer doesn't know are skipped, so more can be added later
+#define HEADER_LENGTH 20
+// the header before this had no version and started with the type, and no
+// type ever sent was 3, so an old packet is never read as a new one
+#define HEADER_VERSION 3
+#define MAX_OPTIONS_LENGTH 40
+#define OPTION_END 0
+// the ranges received beyond ack_number, as 32 bit start and end pairs
+#define OPTION_SACK 1
+// on the SYN/ACK, the longest the receiver holds back an ack, 32 bit us
+#define OPTION_ACK_DELAY 2
+// on a FEC packet, the block it covers: the number of DAT packets, the number
+// of FEC packets, this one's index among them, a zero byte and the length of
+// the last DAT packet (16 bit). The sequence number is the block's first byte
+// and every DAT packet but the last is payload size long
+#define OPTION_FEC 3
+#define FEC_OPTION_LENGTH 8
 
+// a header as read off or about to go on the wire
 typedef struct header {
     uint8 type;
-    uint16 sequence_number;
-    uint16 ack_number;
     uint16 payload_size;
-    uint16 window_size;
+    uint32 sequence_number;
+    uint32 ack_number;
+    uint32 window_size;
+    uint8 *options;
+    int32 options_length;
 } header_t;
 
-#define HEADER_LENGTH 10
+// -v picks how much is printed. Errors always go to stderr
+#define LOG_QUIET 0
+// what a run did: start up, connections, summaries
+#define LOG_INFO 1
+// losses, timeouts and other per packet events
+#define LOG_EVENT 2
+// every packet sent and received, as text
+#define LOG_PACKET 3
+
+int32 log_level = LOG_INFO;
+
+#define LOG(level, ...) do { if(log_level >= (level)) { printf(__VA_ARGS__); } } while(0)
+
+// a range of sequence numbers received beyond ack_number, sent in the
+// OPTION_SACK of an ack
+typedef struct sack_block {
+    uint32 start;
+    uint32 end;
+} sack_block_t;
+
+#define MAX_SACK_BLOCKS 4
+
+// with -k the sender splits a file into ranges and sends each over a flow of
+// its own. The SYN of every flow carries one of these as its payload
+typedef struct flow_range {
+    uint32 transfer_id;
+    uint32 flow_count;
+    uint64 offset;
+} flow_range_t;
+
+// on the wire the three fields in network byte order, offset high word first
+#define FLOW_RANGE_LENGTH 16
+
+#define MAX_FLOWS 64
+
+#ifdef SIMULATION
+// rdpsim runs this file and rdps.c in one process. The clock and the network
+// are its, data is handed to it to check rather than written out, and it
+// drives the receiver through the rdprSim functions below instead of main's
+// loop. Everything else is made local to this file when it is built for the
+// simulator, see the Makefile
+#define SIM_RECEIVER 1
+#define SIM_EXPORT __attribute__((visibility("default")))
+SIM_EXPORT uint64 simNow();
+SIM_EXPORT int32 simSendBatch(int32 from, struct mmsghdr *msgs, int32 count);
+SIM_EXPORT void simDeliverData(uint64 offset, uint8 *data, int32 len);
+SIM_EXPORT void simFinished(int32 endpoint);
+#endif
 
 // handshake
 #define STATE_WAITING 0
@@ -43,18 +144,662 @@ typedef struct header {
 #define STATE_RECEIVING 10
 // fin
 #define STATE_FIN 20
+// fin received, waiting on the other flows of the transfer before acking it
+#define STATE_FIN_WAIT 21
+
+
+// nanoseconds on the monotonic clock
+uint64 getCurrentTime() {
+#ifdef SIMULATION
+    return simNow();
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)(ts.tv_sec) * 1000000000 + (uint64)(ts.tv_nsec);
+}
+
+// HDR style histograms: a row of buckets for every power of two, each row
+// split into HISTOGRAM_SUB_BUCKETS even steps, so any value from 1 to 2^64
+// is kept to within an eighth of itself in a fixed 4KB
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+    uint64 buckets[HISTOGRAM_BUCKETS];
+    uint64 count;
+    uint64 sum;
+    uint64 max;
+} histogram_t;
+
+int32 histogramBucket(uint64 value) {
+    if(value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int32 exponent = 63 - __builtin_clzll(value);
+    int32 step = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + step;
+}
+
+// the smallest value that lands in a bucket
+uint64 histogramBucketStart(int32 bucket) {
+    if(bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int32 exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64 step = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + step) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+// only ever called from one thread per histogram
+void histogramRecord(histogram_t *h, uint64 value) {
+    h->buckets[histogramBucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value > h->max) {
+        h->max = value;
+    }
+}
+
+// the largest value that could be in the bucket holding the given share of
+// samples, so percentiles are never understated
+uint64 histogramPercentile(histogram_t *h, double share) {
+    uint64 wanted = h->count * share;
+    uint64 seen = 0;
+    int32 i;
+    for(i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if(seen > wanted) {
+            uint64 end = histogramBucketStart(i + 1) - 1;
+            return end < h->max ? end : h->max;
+        }
+    }
+    return h->max;
+}
+
+// appends "name":{...} to the JSON being built in buf
+int32 histogramJson(char *buf, int32 len, char *name, histogram_t *h) {
+    return snprintf(buf, len, ",\"%s\":{\"n\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+        name, h->count, h->count > 0 ? h->sum / h->count : 0, histogramPercentile(h, 0.5),
+        histogramPercentile(h, 0.9), histogramPercentile(h, 0.99), h->max);
+}
+
+// counters and histograms behind -j and -u
+uint64 out_of_order_packets;
+uint64 duplicate_packets;
+// in order bytes handed to the writer
+uint64 received_bytes;
+uint64 staging_stalls;
+// the receive window advertised in each ack
+histogram_t window_histogram;
+// us per write to disk, only touched by the writer
+histogram_t disk_write_histogram;
+
+// in order data is copied into a connection's staging ring and one writer
+// thread puts it on disk with pwrite, so a slow disk or a page cache flush
+// never holds up acks. The receive path only waits when a ring is full.
+// Out of order packets go straight to their place in the free part of the
+// ring and are handed to the writer once the gap in front of them is filled,
+// so the room left in the ring is the window the sender is given
+#define MAX_RECEIVED_RANGES 32
+#define STAGING_LENGTH (8 * 1024 * 1024)
+// with -s there can be many connections, so each gets a smaller ring
+#define SERVER_STAGING_LENGTH (1024 * 1024)
+// the writer waits for a whole chunk unless the transfer is over, so writes
+// stay aligned to the chunk size. Staging rings are a multiple of it
+#define WRITE_CHUNK (256 * 1024)
+// with -f the file is preallocated this far ahead of the writer
+#define PREALLOCATE_LENGTH (64 * 1024 * 1024)
+
+// the output file of a transfer, shared by all of its flows. A sender without
+// -k makes a transfer of one flow
+typedef struct transfer {
+    uint32 id;
+    int32 flow_count;
+    int32 flows_opened;
+    // flows whose FIN is in and flows that have been finished off
+    int32 flows_done;
+    int32 flows_closed;
+    int fd;
+    // guarded by staging_lock. The last connection written out after the
+    // transfer is detached closes the file
+    int32 refs;
+    int32 detached;
+    // only touched by the writer
+    uint64 data_end;
+    uint64 preallocated_end;
+    struct transfer *next;
+} transfer_t;
+
+// FEC packets of a block with DAT packets missing are held on to until the
+// block is whole, either rebuilt from them or filled in by retransmits
+#define FEC_PENDING_BLOCKS 16
+
+typedef struct fec_block {
+    uint32 start;
+    // 0 for a free slot
+    int32 count;
+    int32 parity;
+    int32 segment_size;
+    int32 last_size;
+    // a bit for each FEC packet in, their payloads follow each other in data
+    uint32 received;
+    uint8 *data;
+} fec_block_t;
+
+// everything known about one sender. rdpr takes a single transfer, or with -s
+// any number at once on the same port, each found by its source address
+typedef struct connection {
+    struct sockaddr_in addr;
+    int32 state;
+    uint32 pending_syn;
+    uint32 expected_next;
+    // the window last advertised
+    uint32 window_size;
+    time_t last_heard;
+    transfer_t *transfer;
+    // where this flow's range starts in the output
+    uint64 base_offset;
+    uint32 fin_seq;
+    // when the SYN/ACK went out, for the round trip the receive buffer is sized from
+    uint64 syn_ack_time;
+    sack_block_t received_ranges[MAX_RECEIVED_RANGES];
+    int32 received_range_count;
+    uint8 *staging;
+    uint64 staging_length;
+    // bytes handed to the ring and bytes written out, both only ever grow
+    uint64 staged;
+    uint64 written;
+    uint64 preallocated;
+    // set once the connection is handed over to the writer to finish off
+    int32 finishing;
+    int32 write_queued;
+    uint64 disk_writes;
+    uint64 staging_stalls;
+    // in order segments not acked yet, and when the ack for them is due
+    int32 unacked_segments;
+    uint64 ack_deadline;
+    // FEC blocks waiting on packets, allocated with the first FEC packet
+    fec_block_t *fec_blocks;
+    int32 fec_pending;
+    struct connection *ack_prev;
+    struct connection *ack_next;
+    struct connection *next;
+    struct connection *write_next;
+} connection_t;
+
+// connections by source address, -s allows up to MAX_CONNECTIONS of them
+#define CONNECTION_BUCKETS 1024
+#define MAX_CONNECTIONS 1024
+// with -s a connection that hasn't been heard from for this long is dropped
+#define CONNECTION_IDLE_SECONDS 60
+// socket receive buffer asked for with -s, the kernel may cap it
+#define SERVER_RECEIVE_BUFFER (8 * 1024 * 1024)
+
+int32 server_mode;
+// -w worker processes, each with connections of its own
+int32 worker_count;
+int32 worker_id;
+char *output_name;
+connection_t *connection_table[CONNECTION_BUCKETS];
+int32 connection_count;
+uint64 connections_finished;
+// the connection the packet being handled belongs to
+connection_t *conn;
+// transfers with flows still open
+transfer_t *transfers;
+
+// an ack is held back until ack_every in order segments are in or ack_delay
+// has passed since the first of them, -a sets both. Out of order packets and
+// the ones that fill a gap are acked straight away so loss recovery isn't
+// slowed down. The delay is the same for everyone, so connections waiting on
+// it are listed in the order their deadlines come up
+#define DEFAULT_ACK_EVERY 2
+#define DEFAULT_ACK_DELAY 1000000ULL
+#define MAX_ACK_EVERY 64
+#define MAX_ACK_DELAY 1000000000ULL
+
+int32 ack_every = DEFAULT_ACK_EVERY;
+uint64 ack_delay = DEFAULT_ACK_DELAY;
+connection_t *delayed_acks;
+connection_t *delayed_acks_tail;
+uint64 acks_sent;
+
+void scheduleAck(connection_t *c) {
+    if(c->ack_deadline != 0) {
+        return;
+    }
+    c->ack_deadline = getCurrentTime() + ack_delay;
+    c->ack_prev = delayed_acks_tail;
+    c->ack_next = NULL;
+    if(delayed_acks_tail != NULL) {
+        delayed_acks_tail->ack_next = c;
+    } else {
+        delayed_acks = c;
+    }
+    delayed_acks_tail = c;
+}
+
+void cancelAck(connection_t *c) {
+    if(c->ack_deadline == 0) {
+        return;
+    }
+    if(c->ack_prev != NULL) {
+        c->ack_prev->ack_next = c->ack_next;
+    } else {
+        delayed_acks = c->ack_next;
+    }
+    if(c->ack_next != NULL) {
+        c->ack_next->ack_prev = c->ack_prev;
+    } else {
+        delayed_acks_tail = c->ack_prev;
+    }
+    c->ack_deadline = 0;
+}
+
+// connections with data for the writer, all guarded by staging_lock
+connection_t *write_queue_head;
+connection_t *write_queue_tail;
+int32 writer_exit;
+pthread_t writer_thread;
+pthread_mutex_t staging_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t staging_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t staging_space = PTHREAD_COND_INITIALIZER;
+int32 preallocate;
+uint64 total_written;
+
+// must hold staging_lock
+void queueForWriter(connection_t *c) {
+    if(c->write_queued) {
+        return;
+    }
+    c->write_queued = 1;
+    c->write_next = NULL;
+    if(write_queue_tail != NULL) {
+        write_queue_tail->write_next = c;
+    } else {
+        write_queue_head = c;
+    }
+    write_queue_tail = c;
+    pthread_cond_signal(&staging_ready);
+}
+
+void closeTransfer(transfer_t *t) {
+    if(t->preallocated_end > t->data_end) {
+        // give back the blocks preallocated past the end
+        if(ftruncate(t->fd, t->data_end) != 0) {
+            fprintf(stderr, "Error trimming output: %s\n", strerror(errno));
+        }
+    }
+    close(t->fd);
+    free(t);
+}
+
+// runs on the writer once everything staged for a finished connection is out
+void closeOutput(connection_t *c) {
+    transfer_t *t = c->transfer;
+    if(c->base_offset + c->written > t->data_end) {
+        t->data_end = c->base_offset + c->written;
+    }
+    LOG(LOG_INFO, "Disk writer: %llu bytes in %llu writes for %s:%d, receive path waited for ring space %llu times\n",
+        c->written, c->disk_writes, inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->staging_stalls);
+    if(c->fec_blocks != NULL) {
+        int32 i;
+        for(i = 0; i < FEC_PENDING_BLOCKS; i++) {
+            free(c->fec_blocks[i].data);
+        }
+        free(c->fec_blocks);
+    }
+    free(c->staging);
+    free(c);
+    pthread_mutex_lock(&staging_lock);
+    t->refs--;
+    int32 last = t->refs == 0 && t->detached;
+    pthread_mutex_unlock(&staging_lock);
+    if(last) {
+        closeTransfer(t);
+    }
+}
+
+void *writerMain(void *arg) {
+    pthread_mutex_lock(&staging_lock);
+    while(1) {
+        while(write_queue_head == NULL && !writer_exit) {
+            pthread_cond_wait(&staging_ready, &staging_lock);
+        }
+        connection_t *c = write_queue_head;
+        if(c == NULL) {
+            break;
+        }
+        write_queue_head = c->write_next;
+        if(write_queue_head == NULL) {
+            write_queue_tail = NULL;
+        }
+        c->write_queued = 0;
+        uint64 offset = c->written;
+        uint64 pos = offset % c->staging_length;
+        uint64 len = c->staged - offset;
+        if(len > c->staging_length - pos) {
+            len = c->staging_length - pos;
+        }
+        if(!c->finishing) {
+            len -= len % WRITE_CHUNK;
+        }
+        pthread_mutex_unlock(&staging_lock);
+
+        transfer_t *t = c->transfer;
+        if(preallocate && offset + len > c->preallocated) {
+            // keep the size as it is, the file only grows as data is written
+            if(fallocate(t->fd, FALLOC_FL_KEEP_SIZE, c->base_offset + c->preallocated, PREALLOCATE_LENGTH) == 0) {
+                c->preallocated += PREALLOCATE_LENGTH;
+                if(c->base_offset + c->preallocated > t->preallocated_end) {
+                    t->preallocated_end = c->base_offset + c->preallocated;
+                }
+            } else {
+                fprintf(stderr, "Can't preallocate the output file (%s), carrying on without\n", strerror(errno));
+                preallocate = 0;
+            }
+        }
+        uint64 start = getCurrentTime();
+        uint64 done = 0;
+        while(done < len) {
+            ssize_t n = pwrite(t->fd, c->staging + pos + done, len - done, c->base_offset + offset + done);
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            done += n;
+        }
+        if(len > 0) {
+            c->disk_writes++;
+            histogramRecord(&disk_write_histogram, (getCurrentTime() - start) / 1000);
+        }
+
+        pthread_mutex_lock(&staging_lock);
+        c->written += len;
+        total_written += len;
+        pthread_cond_broadcast(&staging_space);
+        // a connection queued again while it was being written is closed
+        // the next time round
+        if(c->finishing && c->written == c->staged && !c->write_queued) {
+            pthread_mutex_unlock(&staging_lock);
+            closeOutput(c);
+            pthread_mutex_lock(&staging_lock);
+        } else if(c->finishing || c->staged - c->written >= WRITE_CHUNK) {
+            queueForWriter(c);
+        }
+    }
+    pthread_mutex_unlock(&staging_lock);
+    return NULL;
+}
+
+void startWriter() {
+    if(pthread_create(&writer_thread, NULL, writerMain, NULL) != 0) {
+        fprintf(stderr, "Failed to start the writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// waits for every finished connection to be written out
+void stopWriter() {
+    pthread_mutex_lock(&staging_lock);
+    writer_exit = 1;
+    pthread_cond_signal(&staging_ready);
+    pthread_mutex_unlock(&staging_lock);
+    pthread_join(writer_thread, NULL);
+}
+
+// the room left in the ring past expected_next
+uint32 receiveWindow(connection_t *c) {
+    pthread_mutex_lock(&staging_lock);
+    uint64 used = c->staged - c->written;
+    pthread_mutex_unlock(&staging_lock);
+    return c->staging_length - used;
+}
+
+// copies data that goes offset bytes past expected_next into the ring
+void copyToStaging(uint64 offset, uint8 *data, int32 len) {
+    uint64 pos = (conn->staged + offset) % conn->staging_length;
+    int32 first = len < conn->staging_length - pos ? len : conn->staging_length - pos;
+    memcpy(conn->staging + pos, data, first);
+    memcpy(conn->staging, data + first, len - first);
+}
+
+// hands the next len bytes of the ring to the writer
+void commitStaged(int32 len) {
+    received_bytes += len;
+#ifdef SIMULATION
+    // there is no writer, the simulator checks the data as it comes in
+    uint64 pos = conn->staged % conn->staging_length;
+    int32 first = len < conn->staging_length - pos ? len : conn->staging_length - pos;
+    simDeliverData(conn->base_offset + conn->staged, conn->staging + pos, first);
+    if(len > first) {
+        simDeliverData(conn->base_offset + conn->staged + first, conn->staging, len - first);
+    }
+    conn->staged += len;
+    conn->written += len;
+    return;
+#endif
+    pthread_mutex_lock(&staging_lock);
+    conn->staged += len;
+    if(conn->staged - conn->written >= WRITE_CHUNK) {
+        queueForWriter(conn);
+    }
+    pthread_mutex_unlock(&staging_lock);
+}
+
+// copies in order data into the ring, only blocking while the ring is full
+void stageData(uint8 *data, int32 len) {
+    pthread_mutex_lock(&staging_lock);
+    if(conn->staged + len - conn->written > conn->staging_length) {
+        conn->staging_stalls++;
+        staging_stalls++;
+        // a full ring holds at least a chunk, so the writer will make room
+        queueForWriter(conn);
+        while(conn->staged + len - conn->written > conn->staging_length) {
+            pthread_cond_wait(&staging_space, &staging_lock);
+        }
+    }
+    pthread_mutex_unlock(&staging_lock);
+
+    // only the receive path touches the free part of the ring
+    copyToStaging(0, data, len);
+    commitStaged(len);
+}
+
+uint32 connectionBucket(struct sockaddr_in *addr) {
+    return (addr->sin_addr.s_addr * 31 + addr->sin_port) % CONNECTION_BUCKETS;
+}
+
+connection_t *findConnection(struct sockaddr_in *addr) {
+    connection_t *c = connection_table[connectionBucket(addr)];
+    while(c != NULL && (c->addr.sin_addr.s_addr != addr->sin_addr.s_addr || c->addr.sin_port != addr->sin_port)) {
+        c = c->next;
+    }
+    return c;
+}
+
+transfer_t *findTransfer(uint32 id) {
+    transfer_t *t = transfers;
+    while(t != NULL && t->id != id) {
+        t = t->next;
+    }
+    return t;
+}
+
+// opens the output for a new transfer, a range from the SYN means there are
+// other flows to come writing to the same file
+transfer_t *openTransfer(struct sockaddr_in *addr, flow_range_t *range) {
+    char path[4096];
+    if(server_mode && range != NULL) {
+        // one output per transfer, named after where it came from
+        snprintf(path, sizeof path, "%s.%s.t%u", output_name, inet_ntoa(addr->sin_addr), range->transfer_id);
+    } else if(server_mode) {
+        // one output per sender, named after where it came from
+        snprintf(path, sizeof path, "%s.%s.%d", output_name, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    } else {
+        snprintf(path, sizeof path, "%s", output_name);
+    }
+    transfer_t *t = (transfer_t*) calloc(1, sizeof(transfer_t));
+    if(t == NULL) {
+        fprintf(stderr, "Failed to allocate a transfer\n");
+        return NULL;
+    }
+#ifdef SIMULATION
+    // the simulator checks the data as it arrives, nothing goes to disk
+    t->fd = -1;
+#else
+    t->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if(t->fd < 0) {
+        fprintf(stderr, "Error opening %s for writing.\n", path);
+        free(t);
+        return NULL;
+    }
+    // another worker writing the same transfer holds the lock until it is
+    // done, its file must not be truncated under it
+    if(flock(t->fd, LOCK_EX | LOCK_NB) != 0) {
+        LOG(LOG_INFO, "Turning away %s:%d, %s is being written by another worker\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), path);
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    if(ftruncate(t->fd, 0) != 0) {
+        fprintf(stderr, "Error truncating %s: %s\n", path, strerror(errno));
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+#endif
+    t->id = range != NULL ? range->transfer_id : 0;
+    t->flow_count = range != NULL ? range->flow_count : 1;
+    t->next = transfers;
+    transfers = t;
+    LOG(LOG_INFO, "New transfer from %s writing to %s in %d flows\n", inet_ntoa(addr->sin_addr), path, t->flow_count);
+    return t;
+}
+
+// sets up state for a new sender, NULL if it can't be taken on
+connection_t *openConnection(struct sockaddr_in *addr, flow_range_t *range) {
+    transfer_t *t = NULL;
+    if(range != NULL) {
+        if(range->flow_count < 1 || range->flow_count > MAX_FLOWS) {
+            LOG(LOG_INFO, "Turning away %s:%d, bad flow count %u\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), range->flow_count);
+            return NULL;
+        }
+        t = findTransfer(range->transfer_id);
+    }
+    if(t != NULL && t->flows_opened == t->flow_count) {
+        LOG(LOG_INFO, "Turning away %s:%d, transfer %u already has all its flows\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), t->id);
+        return NULL;
+    }
+    // without -s only the flows of the first transfer are taken
+    int32 room = server_mode ? connection_count < MAX_CONNECTIONS : t != NULL || (transfers == NULL && connections_finished == 0);
+    if(!room) {
+        LOG(LOG_INFO, "Turning away %s:%d, no room for another connection\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        return NULL;
+    }
+    connection_t *c = (connection_t*) calloc(1, sizeof(connection_t));
+    if(c == NULL) {
+        fprintf(stderr, "Failed to allocate a connection\n");
+        return NULL;
+    }
+    c->staging_length = server_mode ? SERVER_STAGING_LENGTH : STAGING_LENGTH;
+    c->staging = (uint8*) malloc(c->staging_length);
+    if(c->staging == NULL) {
+        fprintf(stderr, "Failed to allocate a staging ring\n");
+        free(c);
+        return NULL;
+    }
+    if(t == NULL) {
+        t = openTransfer(addr, range);
+        if(t == NULL) {
+            free(c->staging);
+            free(c);
+            return NULL;
+        }
+    }
+    t->flows_opened++;
+    pthread_mutex_lock(&staging_lock);
+    t->refs++;
+    pthread_mutex_unlock(&staging_lock);
+    c->transfer = t;
+    c->base_offset = range != NULL ? range->offset : 0;
+    memcpy(&c->addr, addr, sizeof(struct sockaddr_in));
+    c->state = STATE_WAITING;
+    uint32 bucket = connectionBucket(addr);
+    c->next = connection_table[bucket];
+    connection_table[bucket] = c;
+    connection_count++;
+    LOG(LOG_INFO, "New connection from %s:%d at offset %llu, %d open on worker %d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), c->base_offset, connection_count, worker_id);
+    return c;
+}
+
+// takes the connection out of the table and leaves the writer to flush and
+// free it. Once no flow of its transfer is left the transfer goes too, a
+// dropped flow gives up on the flows that never turned up
+void finishConnection(connection_t *c, int32 dropped) {
+    connection_t **link = &connection_table[connectionBucket(&c->addr)];
+    while(*link != c) {
+        link = &(*link)->next;
+    }
+    *link = c->next;
+    cancelAck(c);
+    connection_count--;
+    connections_finished++;
+    transfer_t *t = c->transfer;
+    t->flows_closed++;
+    int32 detach = t->flows_closed == t->flow_count || (dropped && t->flows_closed == t->flows_opened);
+    if(detach) {
+        transfer_t **tlink = &transfers;
+        while(*tlink != t) {
+            tlink = &(*tlink)->next;
+        }
+        *tlink = t->next;
+    }
+    pthread_mutex_lock(&staging_lock);
+    // the connection holds a reference until the writer is done with it, so
+    // the writer is always the one to close the transfer
+    t->detached = detach;
+    c->finishing = 1;
+#ifdef SIMULATION
+    // there is no writer, everything went to the simulator as it came in
+    pthread_mutex_unlock(&staging_lock);
+    closeOutput(c);
+    return;
+#endif
+    queueForWriter(c);
+    pthread_mutex_unlock(&staging_lock);
+}
 
+time_t last_idle_check;
 
-int32 state;
-uint32 pending_syn;
-uint16 expected_next;
-FILE *receiving_file;
-uint16 window_size;
+void dropIdleConnections() {
+    time_t now = time(NULL);
+    if(now == last_idle_check) {
+        return;
+    }
+    last_idle_check = now;
+    int32 i;
+    for(i = 0; i < CONNECTION_BUCKETS; i++) {
+        connection_t *c = connection_table[i];
+        while(c != NULL) {
+            connection_t *next = c->next;
+            if(now - c->last_heard > CONNECTION_IDLE_SECONDS) {
+                LOG(LOG_INFO, "Dropping connection from %s:%d, idle for %d seconds\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), (int32) (now - c->last_heard));
+                finishConnection(c, 1);
+            }
+            c = next;
+        }
+    }
+}
 
 char *sender_ip;
 int32 sender_port;
-char *receiver_ip;
-int32 receiver_port;
+// the sender of the packet being handled
+struct sockaddr_in receiver_addr;
 
 char *toTypeStr(uint8 type) {
     if(type == TYPE_ACK) {
@@ -67,6 +812,14 @@ char *toTypeStr(uint8 type) {
         return "DAT";
     } else if(type == TYPE_FIN) {
         return "FIN";
+    } else if(type == (TYPE_ACK | TYPE_SACK)) {
+        return "SACK";
+    } else if(type == TYPE_PRB) {
+        return "PRB";
+    } else if(type == (TYPE_ACK | TYPE_PRB)) {
+        return "PRB/ACK";
+    } else if(type == TYPE_FEC) {
+        return "FEC";
     }
     return "UNK";
 }
@@ -74,12 +827,18 @@ char *toTypeStr(uint8 type) {
 int isDat(header_t *hdr) {
     return (hdr->type & TYPE_DAT) != 0;
 }
+int isFec(header_t *hdr) {
+    return (hdr->type & TYPE_FEC) != 0;
+}
 int isSyn(header_t *hdr) {
     return (hdr->type & TYPE_SYN) != 0;
 }
 int isAck(header_t *hdr) {
     return (hdr->type & TYPE_ACK) != 0;
 }
+int isPrb(header_t *hdr) {
+    return (hdr->type & TYPE_PRB) != 0;
+}
 int isFin(header_t *hdr) {
     return (hdr->type & TYPE_FIN) != 0;
 }
@@ -87,191 +846,1682 @@ int isRst(header_t *hdr) {
     return (hdr->type & TYPE_RST) != 0;
 }
 
+// with -t every packet is traced as a fixed size binary record. The main
+// thread puts records in a ring and a thread of its own writes them out, so
+// a packet costs a few stores rather than a printf. A full ring drops records
+// instead of holding up the sender. rdpt decodes a trace back into the text
+// that -v 3 prints
+#define TRACE_MAGIC 0x54504452
+#define TRACE_VERSION 2
+// records, a power of two
+#define TRACE_RING_LENGTH 65536
+#define TRACE_DRAIN_INTERVAL 10000000
+
+typedef struct trace_file_header {
+    uint32 magic;
+    uint32 version;
+    // the two clocks read together, so record times map to the wall clock
+    uint64 realtime_base;
+    uint64 monotonic_base;
+} trace_file_header_t;
+
+typedef struct trace_record {
+    // CLOCK_MONOTONIC ns
+    uint64 time;
+    // addresses in network order, ports in host order
+    uint32 local_addr;
+    uint32 remote_addr;
+    uint32 sequence_number;
+    uint32 ack_number;
+    uint32 window_size;
+    uint16 local_port;
+    uint16 remote_port;
+    uint16 payload_size;
+    uint8 sent;
+    uint8 type;
+    uint32 reserved;
+} trace_record_t;
+
+int32 tracing;
+int trace_fd;
+trace_record_t *trace_ring;
+// only the main thread moves trace_head and only the drain thread trace_tail
+uint64 trace_head;
+uint64 trace_tail;
+int32 trace_stop;
+uint64 trace_dropped;
+uint32 trace_local_addr;
+uint16 trace_local_port;
+pthread_t trace_thread;
+
+void traceRecord(header_t *hdr, int sent, uint32 remote_addr, uint16 remote_port) {
+    uint64 head = trace_head;
+    if(head - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) == TRACE_RING_LENGTH) {
+        trace_dropped++;
+        return;
+    }
+    trace_record_t *r = &trace_ring[head & (TRACE_RING_LENGTH - 1)];
+    r->time = getCurrentTime();
+    r->local_addr = trace_local_addr;
+    r->remote_addr = remote_addr;
+    r->local_port = trace_local_port;
+    r->remote_port = remote_port;
+    r->sequence_number = hdr->sequence_number;
+    r->ack_number = hdr->ack_number;
+    r->payload_size = hdr->payload_size;
+    r->window_size = hdr->window_size;
+    r->sent = sent;
+    r->type = hdr->type;
+    r->reserved = 0;
+    __atomic_store_n(&trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void *traceMain(void *arg) {
+    struct timespec interval = {0, TRACE_DRAIN_INTERVAL};
+    while(1) {
+        // anything traced before the stop is seen is still written out
+        int32 stop = __atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE);
+        uint64 head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+        uint64 tail = trace_tail;
+        while(tail != head) {
+            uint64 pos = tail & (TRACE_RING_LENGTH - 1);
+            uint64 count = head - tail < TRACE_RING_LENGTH - pos ? head - tail : TRACE_RING_LENGTH - pos;
+            uint8 *data = (uint8*) &trace_ring[pos];
+            uint64 len = count * sizeof(trace_record_t);
+            while(len > 0) {
+                ssize_t n = write(trace_fd, data, len);
+                if(n < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    fprintf(stderr, "Error writing the trace, no longer tracing: %s\n", strerror(errno));
+                    return NULL;
+                }
+                data += n;
+                len -= n;
+            }
+            tail += count;
+            __atomic_store_n(&trace_tail, tail, __ATOMIC_RELEASE);
+        }
+        if(stop) {
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// writes out what is left in the ring, runs at exit
+void stopTrace() {
+    if(!tracing) {
+        return;
+    }
+    tracing = 0;
+    __atomic_store_n(&trace_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_thread, NULL);
+    close(trace_fd);
+    if(trace_dropped > 0) {
+        fprintf(stderr, "Trace ring overflowed, %llu records dropped\n", trace_dropped);
+    }
+}
+
+void startTrace(char *path, char *local_ip, int32 local_port) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(trace_fd < 0) {
+        fprintf(stderr, "Error opening %s for the trace: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    trace_ring = (trace_record_t*) malloc(TRACE_RING_LENGTH * sizeof(trace_record_t));
+    if(trace_ring == NULL) {
+        fprintf(stderr, "Failed to allocate the trace ring\n");
+        exit(EXIT_FAILURE);
+    }
+    trace_file_header_t header;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.realtime_base = (uint64)(ts.tv_sec) * 1000000000 + (uint64)(ts.tv_nsec);
+    header.monotonic_base = getCurrentTime();
+    if(write(trace_fd, &header, sizeof header) != sizeof header) {
+        fprintf(stderr, "Error writing the trace: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    trace_local_addr = inet_addr(local_ip);
+    trace_local_port = local_port;
+    if(pthread_create(&trace_thread, NULL, traceMain, NULL) != 0) {
+        fprintf(stderr, "Failed to start the trace thread\n");
+        exit(EXIT_FAILURE);
+    }
+    tracing = 1;
+    atexit(stopTrace);
+}
+
 void logPacket(header_t *hdr, int sent) {
+    if(tracing) {
+        traceRecord(hdr, sent, receiver_addr.sin_addr.s_addr, ntohs(receiver_addr.sin_port));
+    }
+    if(log_level < LOG_PACKET) {
+        return;
+    }
     char buf[150];
     time_t curtime;
     struct tm *loc_time;
+#ifdef SIMULATION
+    // simulated time, so the same run always logs the same lines
+    curtime = getCurrentTime() / 1000000000;
+    loc_time = gmtime (&curtime);
+#else
     curtime = time (NULL);
     loc_time = localtime (&curtime);
+#endif
     strftime (buf, 150, "%T", loc_time);
 
     char s = sent ? 's' : 'r';
-    int32 seqno = isAck(hdr) ? hdr->ack_number : hdr->sequence_number;
-    int32 length = isDat(hdr) ? hdr->payload_size : hdr->window_size;
+    uint32 seqno = isAck(hdr) ? hdr->ack_number : hdr->sequence_number;
+    uint32 length = isDat(hdr) || isFec(hdr) ? hdr->payload_size : hdr->window_size;
 
-    printf("%s %c %s:%d %s:%d %s %d %d\n", buf, s, sender_ip, sender_port, receiver_ip, receiver_port, toTypeStr(hdr->type), seqno, length);
+    printf("%s %c %s:%d %s:%d %s %u %u\n", buf, s, sender_ip, sender_port, inet_ntoa(receiver_addr.sin_addr), ntohs(receiver_addr.sin_port), toTypeStr(hdr->type), seqno, length);
 }
 
-header_t *createHeader(uint8 *buffer, int32 *buffer_index) {
-    header_t *hdr = (header_t*) buffer + *buffer_index;
-    (*buffer_index) += 10;
-    buffer[*buffer_index - 1] = '\n';
-    return hdr;
+// sequence numbers wrap, so they are only ordered relative to each other
+int seqBefore(uint32 a, uint32 b) {
+    return (int32)(a - b) < 0;
 }
 
-void flushOut(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
-    int32 bytes_sent = sendto(sock, buffer, *buffer_index, 0, sa, sa_size);
-    if (bytes_sent < 0) {
-        printf("Error sending packet: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+void putUint16(uint8 *p, uint16 value) {
+    value = htons(value);
+    memcpy(p, &value, sizeof value);
+}
+
+void putUint32(uint8 *p, uint32 value) {
+    value = htonl(value);
+    memcpy(p, &value, sizeof value);
+}
+
+uint16 getUint16(uint8 *p) {
+    uint16 value;
+    memcpy(&value, p, sizeof value);
+    return ntohs(value);
+}
+
+uint32 getUint32(uint8 *p) {
+    uint32 value;
+    memcpy(&value, p, sizeof value);
+    return ntohl(value);
+}
+
+// encodes hdr and its options at the end of buffer
+void writeHeader(header_t *hdr, uint8 *buffer, int32 *buffer_index) {
+    uint8 *p = buffer + *buffer_index;
+    int32 padded = (hdr->options_length + 3) & ~3;
+    p[0] = HEADER_VERSION;
+    p[1] = hdr->type;
+    p[2] = padded / 4;
+    p[3] = 0;
+    putUint32(p + 4, hdr->sequence_number);
+    putUint32(p + 8, hdr->ack_number);
+    putUint32(p + 12, hdr->window_size);
+    putUint16(p + 16, hdr->payload_size);
+    putUint16(p + 18, 0);
+    if(hdr->options_length > 0) {
+        memcpy(p + HEADER_LENGTH, hdr->options, hdr->options_length);
     }
-    (*buffer_index) = 0;
+    memset(p + HEADER_LENGTH + hdr->options_length, OPTION_END, padded - hdr->options_length);
+    (*buffer_index) += HEADER_LENGTH + padded;
 }
 
-void readPacket(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
-    window_size = (PACKET_BUFFER_LENGTH - (*buffer_index)) / 2;
-    //printf("Recieved packet type %s sequence %d ack %d payload %d window %d\n", toTypeStr(hdr->type), hdr->sequence_number, hdr->ack_number, hdr->payload_size, hdr->window_size);
-    logPacket(hdr, 0);
-    if(state == STATE_WAITING && isSyn(hdr)) {
-        header_t *resp = createHeader(buffer, buffer_index);
-        resp->type = TYPE_SYN | TYPE_ACK;
-        resp->sequence_number = hdr->sequence_number + 1;
-        pending_syn = resp->sequence_number;
-        resp->ack_number = hdr->sequence_number;
-        resp->payload_size = 0;
-        resp->window_size = window_size;
-        logPacket(resp, 1);
-        flushOut(sock, buffer, buffer_index, sa, sa_size);
-        state = STATE_SYN;
-        expected_next = pending_syn + 1;
-    } else if(state == STATE_SYN) {
-        if(isAck(hdr)) {
-            if(pending_syn != hdr->ack_number) {
-                return;
-            }
-            state = STATE_RECEIVING;
+// decodes the header at the start of a packet. Returns where the payload
+// starts, or 0 for a packet of another version or one cut short
+int32 readHeader(uint8 *packet, int32 len, header_t *hdr) {
+    if(len < HEADER_LENGTH) {
+        return 0;
+    }
+    hdr->type = packet[1];
+    hdr->options_length = packet[2] * 4;
+    hdr->sequence_number = getUint32(packet + 4);
+    hdr->ack_number = getUint32(packet + 8);
+    hdr->window_size = getUint32(packet + 12);
+    hdr->payload_size = getUint16(packet + 16);
+    hdr->options = packet + HEADER_LENGTH;
+    int32 payload = HEADER_LENGTH + hdr->options_length;
+    if(packet[0] != HEADER_VERSION || len < payload + hdr->payload_size) {
+        return 0;
+    }
+    return payload;
+}
+
+// the data of the first option of a kind, NULL if there is none. len is set
+// to the length of the data
+uint8 *findOption(header_t *hdr, uint8 kind, int32 *len) {
+    int32 i = 0;
+    while(i + 2 <= hdr->options_length && hdr->options[i] != OPTION_END) {
+        int32 option_length = hdr->options[i + 1];
+        if(option_length < 2 || i + option_length > hdr->options_length) {
+            break;
         }
-    } else if(state == STATE_RECEIVING) {
-        if(isDat(hdr)) {
-            if(hdr->sequence_number != expected_next) {
-                printf("Packet LOSS! got %d but expected %d\n", hdr->sequence_number, expected_next);
-                header_t *resp = createHeader(buffer, buffer_index);
-                resp->type = TYPE_ACK;
-                resp->sequence_number = 0;
-                resp->ack_number = expected_next;
-                resp->payload_size = 0;
-                resp->window_size = window_size;
-                logPacket(resp, 1);
-                flushOut(sock, buffer, buffer_index, sa, sa_size);
-                return;
-            }
-            fwrite(payload, 1, hdr->payload_size, receiving_file);
-
-            header_t *resp = createHeader(buffer, buffer_index);
-            resp->type = TYPE_ACK;
-            resp->sequence_number = 0;
-            expected_next = hdr->sequence_number + hdr->payload_size;
-            resp->ack_number = hdr->sequence_number;
-            resp->payload_size = 0;
-            resp->window_size = window_size;
-            logPacket(resp, 1);
-            flushOut(sock, buffer, buffer_index, sa, sa_size);
-        } else if(isFin(hdr)) {
-            state = STATE_FIN;
-            {
-                header_t *resp = createHeader(buffer, buffer_index);
-                resp->type = TYPE_ACK;
-                resp->sequence_number = 0;
-                resp->ack_number = hdr->sequence_number;
-                resp->payload_size = 0;
-                resp->window_size = 4096;
-                logPacket(resp, 1);
-                flushOut(sock, buffer, buffer_index, sa, sa_size);
-            }
-            {
-                header_t *resp = createHeader(buffer, buffer_index);
-                resp->type = TYPE_FIN;
-                resp->sequence_number = hdr->sequence_number + 1;
-                pending_syn = resp->sequence_number;
-                resp->ack_number = 0;
-                resp->payload_size = 0;
-                resp->window_size = 4096;
-                logPacket(resp, 1);
-                flushOut(sock, buffer, buffer_index, sa, sa_size);
-            }
+        if(hdr->options[i] == kind) {
+            *len = option_length - 2;
+            return hdr->options + i + 2;
         }
-    } else if(state == STATE_FIN) {
-        if(isAck(hdr)) {
-            if(hdr->ack_number != pending_syn) {
-                return;
+        i += option_length;
+    }
+    return NULL;
+}
+
+// outgoing packets are queued and handed to the kernel with one sendmmsg per
+// batch, and incoming ones are drained with recvmmsg. -b sets the batch size
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 1024
+// room for a header and any SACK blocks, payloads are sent from where they are
+#define QUEUED_HEADER_LENGTH 64
+
+typedef struct queued_packet {
+    uint8 header[QUEUED_HEADER_LENGTH];
+    struct sockaddr_storage addr;
+} queued_packet_t;
+
+int32 batch_size;
+queued_packet_t *send_queue;
+struct mmsghdr *send_msgs;
+struct iovec *send_iovs;
+int32 send_queue_length;
+uint8 *recv_buffers;
+struct mmsghdr *recv_msgs;
+struct iovec *recv_iovs;
+struct sockaddr_in *recv_addrs;
+// syscall accounting, printed when the transfer finishes
+uint64 send_calls;
+uint64 sent_datagrams;
+uint64 recv_calls;
+uint64 received_datagrams;
+
+void initBatches(int32 size) {
+    batch_size = size;
+    send_queue = (queued_packet_t*) calloc(size, sizeof(queued_packet_t));
+    send_msgs = (struct mmsghdr*) calloc(size, sizeof(struct mmsghdr));
+    send_iovs = (struct iovec*) calloc(size * 2, sizeof(struct iovec));
+    recv_buffers = (uint8*) malloc((size_t) size * PACKET_BUFFER_LENGTH);
+    recv_msgs = (struct mmsghdr*) calloc(size, sizeof(struct mmsghdr));
+    recv_iovs = (struct iovec*) calloc(size, sizeof(struct iovec));
+    recv_addrs = (struct sockaddr_in*) calloc(size, sizeof(struct sockaddr_in));
+    if(!send_queue || !send_msgs || !send_iovs || !recv_buffers || !recv_msgs || !recv_iovs || !recv_addrs) {
+        fprintf(stderr, "Failed to allocate batches of %d packets\n", size);
+        exit(EXIT_FAILURE);
+    }
+    int32 i;
+    for(i = 0; i < size; i++) {
+        recv_iovs[i].iov_base = recv_buffers + (size_t) i * PACKET_BUFFER_LENGTH;
+        recv_iovs[i].iov_len = PACKET_BUFFER_LENGTH;
+        recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+        recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        recv_msgs[i].msg_hdr.msg_name = &recv_addrs[i];
+    }
+}
+
+int32 sendBatch(int32 sock, struct mmsghdr *msgs, int32 count) {
+#ifdef SIMULATION
+    return simSendBatch(SIM_RECEIVER, msgs, count);
+#endif
+    return sendmmsg(sock, msgs, count, 0);
+}
+
+void flushQueue(int32 sock) {
+    int32 done = 0;
+    while(done < send_queue_length) {
+        int32 sent = sendBatch(sock, send_msgs + done, send_queue_length - done);
+        send_calls++;
+        if (sent < 0) {
+            if(errno == EINTR) {
+                continue;
             }
-            close(sock);
-            exit(0);
+            printf("Error sending packet: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
         }
+        done += sent;
     }
+    sent_datagrams += send_queue_length;
+    send_queue_length = 0;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc != 4) {
-        printf("Usage: ./rdpr <reciever_ip> <reciever_port> <output_file>\n");
-        return 0;
+// queues the header sitting in buffer, followed by a payload that is sent
+// from where it lives. The payload must stay put until the queue is flushed
+void queuePacket(int32 sock, uint8 *buffer, int32 *buffer_index, uint8 *payload, int32 len, struct sockaddr*sa, int32 sa_size) {
+    if(*buffer_index > QUEUED_HEADER_LENGTH) {
+        fprintf(stderr, "Packet header of %d bytes is too long to queue\n", *buffer_index);
+        exit(EXIT_FAILURE);
+    }
+    if(send_queue_length == batch_size) {
+        flushQueue(sock);
     }
-    sender_port = atoi(argv[2]);
-    sender_ip = argv[1];
-    char *output = argv[3];
+    int32 i = send_queue_length++;
+    queued_packet_t *queued = &send_queue[i];
+    memcpy(queued->header, buffer, *buffer_index);
+    memcpy(&queued->addr, sa, sa_size);
+    send_iovs[2 * i].iov_base = queued->header;
+    send_iovs[2 * i].iov_len = *buffer_index;
+    send_iovs[2 * i + 1].iov_base = payload;
+    send_iovs[2 * i + 1].iov_len = len;
+    memset(&send_msgs[i], 0, sizeof(struct mmsghdr));
+    send_msgs[i].msg_hdr.msg_name = &queued->addr;
+    send_msgs[i].msg_hdr.msg_namelen = sa_size;
+    send_msgs[i].msg_hdr.msg_iov = &send_iovs[2 * i];
+    send_msgs[i].msg_hdr.msg_iovlen = len > 0 ? 2 : 1;
+    (*buffer_index) = 0;
+}
 
-    printf("Starting RDP reciever on port %s:%d outputting to %s\n", sender_ip, sender_port, output);
+// received datagrams come with a SO_RXQ_OVFL control message, and with -g a
+// UDP_GRO one. With -g the kernel may hand over several datagrams from one
+// sender glued together, the UDP_GRO message gives the size they were cut at
+typedef union recv_control {
+    char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32))];
+    struct cmsghdr align;
+} recv_control_t;
 
-    receiving_file = fopen(output, "wb");
-    if(!receiving_file) {
-        fprintf(stderr, "Error opening %s for writing.\n", output);
-        return 0;
-    }
+recv_control_t *recv_controls;
+int32 use_gro;
+uint64 gro_datagrams;
+uint64 gro_packets;
 
-    state = STATE_WAITING;
+void initControls() {
+    recv_controls = (recv_control_t*) calloc(batch_size, sizeof(recv_control_t));
+    if(!recv_controls) {
+        fprintf(stderr, "Failed to allocate control messages for batches of %d packets\n", batch_size);
+        exit(EXIT_FAILURE);
+    }
+    int32 i;
+    for(i = 0; i < batch_size; i++) {
+        recv_msgs[i].msg_hdr.msg_control = recv_controls[i].buf;
+    }
+}
 
-    int32 s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (s == -1) {
-        fprintf(stderr, "Failed to create socket\n");
-        fprintf(stderr, "%s\n", strerror(errno));
-        return 1;
+void initGro(int32 sock) {
+    int32 on = 1;
+    if(setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof on) != 0) {
+        fprintf(stderr, "UDP GRO not supported (%s), receiving one datagram per packet\n", strerror(errno));
+        use_gro = 0;
     }
+}
 
-    struct sockaddr_in sa;
-    ssize_t recsize;
-    socklen_t fromlen;
+// socket buffers start out at the kernel's defaults and only ever grow, to
+// fit the bandwidth delay product as it is measured. The kernel doubles what
+// it is asked for to allow for its overhead per datagram, and unless we may
+// use SO_RCVBUFFORCE it holds what we ask for to net.core.rmem_max
+#define MAX_SOCKET_BUFFER (64 * 1024 * 1024)
 
-    memset(&sa, 0, sizeof sa);
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = inet_addr(sender_ip);
-    sa.sin_port = htons(sender_port);
-    fromlen = sizeof(sa);
-    if (bind(s, (struct sockaddr *)&sa, sizeof sa) == -1) {
-        fprintf(stderr, "Failed to bind port\n");
-        fprintf(stderr, "%s\n", strerror(errno));
-        close(s);
-        return 1;
+// what SO_RCVBUF was last asked for
+int32 receive_buffer_size;
+// datagrams the kernel dropped for want of receive buffer
+uint64 kernel_drops;
+
+// grows a socket buffer to wanted bytes, *size is what it was last asked for
+void growSocketBuffer(int32 sock, int32 option, int32 force_option, int32 *size, uint64 wanted) {
+#ifdef SIMULATION
+    return;
+#endif
+    if(wanted > MAX_SOCKET_BUFFER) {
+        wanted = MAX_SOCKET_BUFFER;
     }
+    if(wanted <= *size) {
+        return;
+    }
+    *size = wanted;
+    if(setsockopt(sock, SOL_SOCKET, force_option, size, sizeof *size) != 0) {
+        setsockopt(sock, SOL_SOCKET, option, size, sizeof *size);
+    }
+    int32 actual = 0;
+    socklen_t len = sizeof actual;
+    getsockopt(sock, SOL_SOCKET, option, &actual, &len);
+    LOG(LOG_EVENT, "Socket buffer grown to %d bytes, %llu asked for\n", actual, wanted);
+}
 
-    int32 opt = 1;
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+// the longest handshake round trip seen, and the data that has come in since
+// round_start
+uint64 path_rtt;
+uint64 round_start;
+uint64 round_bytes;
 
-    uint8 output_buffer[PACKET_BUFFER_LENGTH];
-    int32 output_index = 0;
-    uint8 packet_buffer[PACKET_BUFFER_LENGTH];
-    int32 buffer_index = 0;
-    window_size = 4096;
-    while (1) {
-        recsize = recvfrom(s, (void*) packet_buffer + buffer_index, sizeof packet_buffer - buffer_index, 0, (struct sockaddr*)&sa, &fromlen);
-        receiver_port = sa.sin_port;
-        receiver_ip = inet_ntoa(sa.sin_addr);
-        printf("Received %lld\n", recsize);
-        if (recsize < 0) {
-            fprintf(stderr, "%s\n", strerror(errno));
+void noteRoundTrip(connection_t *c) {
+    uint64 rtt = getCurrentTime() - c->syn_ack_time;
+    if(rtt > path_rtt) {
+        path_rtt = rtt;
+    }
+}
+
+// grows the receive buffer to hold two round trips of what comes in during one
+void tuneReceiveBuffer(int32 sock, int32 len) {
+    if(path_rtt == 0) {
+        return;
+    }
+    uint64 now = getCurrentTime();
+    if(round_start == 0) {
+        round_start = now;
+    }
+    round_bytes += len;
+    if(now - round_start < path_rtt) {
+        return;
+    }
+    uint64 bdp = round_bytes * path_rtt / (now - round_start);
+    growSocketBuffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, &receive_buffer_size, 2 * bdp);
+    round_start = now;
+    round_bytes = 0;
+}
+
+// every datagram carries how many the kernel has dropped on the socket so
+// far, a rise means the receive buffer overflowed
+void noteKernelDrops(int32 sock, struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32 drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof drops);
+            if(drops > kernel_drops) {
+                LOG(LOG_EVENT, "Kernel dropped %llu datagrams for want of receive buffer\n", drops - kernel_drops);
+                kernel_drops = drops;
+                growSocketBuffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, &receive_buffer_size, 2 * (uint64) receive_buffer_size);
+            }
+        }
+    }
+}
+
+// the size the i'th received datagram was coalesced at, or its whole length
+int32 groSegmentSize(int32 i) {
+    int32 len = recv_msgs[i].msg_len;
+    if(!use_gro) {
+        return len;
+    }
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&recv_msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&recv_msgs[i].msg_hdr, cmsg)) {
+        if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof size);
+            if(size > 0 && size < len) {
+                gro_datagrams++;
+                gro_packets += (len + size - 1) / size;
+                return size;
+            }
+        }
+    }
+    return len;
+}
+
+// receives up to a batch of datagrams, returns how many or -1 with errno set
+int32 receiveBatch(int32 sock, int32 flags) {
+    int32 i;
+    for(i = 0; i < batch_size; i++) {
+        recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        recv_msgs[i].msg_hdr.msg_controllen = sizeof(recv_controls[i].buf);
+    }
+    int32 received = recvmmsg(sock, recv_msgs, batch_size, flags, NULL);
+    recv_calls++;
+    if(received > 0) {
+        received_datagrams += received;
+        // the count only grows, so the last datagram has the latest
+        noteKernelDrops(sock, &recv_msgs[received - 1].msg_hdr);
+    }
+    return received;
+}
+
+void printBatchStats(uint64 data_bytes) {
+    LOG(LOG_INFO, "Batched I/O: %llu datagrams sent in %llu calls, %llu received in %llu calls", sent_datagrams, send_calls, received_datagrams, recv_calls);
+    if(data_bytes > 0) {
+        double mb = data_bytes / 1000000.0;
+        LOG(LOG_INFO, ", %.1f syscalls per MB instead of %.1f", (send_calls + recv_calls) / mb, (sent_datagrams + received_datagrams) / mb);
+    }
+    LOG(LOG_INFO, "\n");
+}
+
+// queues the packet in buffer, it goes out with the next flushQueue
+void flushOut(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    queuePacket(sock, buffer, buffer_index, NULL, 0, sa, sa_size);
+}
+
+// stores a packet that arrived ahead of expected_next, returns 0 if it had to
+// be dropped
+int storeOutOfOrder(header_t *hdr, uint8 *payload) {
+    uint32 start = hdr->sequence_number;
+    uint32 end = start + hdr->payload_size;
+    if(!seqBefore(conn->expected_next, start) || end - conn->expected_next > receiveWindow(conn)) {
+        return 0;
+    }
+    sack_block_t *ranges = conn->received_ranges;
+    int32 i = 0;
+    while(i < conn->received_range_count && seqBefore(ranges[i].end, start)) {
+        i++;
+    }
+    if(i < conn->received_range_count && !seqBefore(end, ranges[i].start)) {
+        // touches an existing range, grow it and merge any it now reaches
+        if(seqBefore(start, ranges[i].start)) {
+            ranges[i].start = start;
+        }
+        if(seqBefore(ranges[i].end, end)) {
+            ranges[i].end = end;
+        }
+        while(i + 1 < conn->received_range_count && !seqBefore(ranges[i].end, ranges[i + 1].start)) {
+            if(seqBefore(ranges[i].end, ranges[i + 1].end)) {
+                ranges[i].end = ranges[i + 1].end;
+            }
+            memmove(&ranges[i + 1], &ranges[i + 2], (conn->received_range_count - i - 2) * sizeof(sack_block_t));
+            conn->received_range_count--;
+        }
+    } else {
+        if(conn->received_range_count == MAX_RECEIVED_RANGES) {
+            return 0;
+        }
+        memmove(&ranges[i + 1], &ranges[i], (conn->received_range_count - i) * sizeof(sack_block_t));
+        ranges[i].start = start;
+        ranges[i].end = end;
+        conn->received_range_count++;
+    }
+    copyToStaging(start - conn->expected_next, payload, hdr->payload_size);
+    return 1;
+}
+
+// hands the writer any stored ranges that expected_next has caught up with,
+// they are already in place in the ring
+void deliverReassembled() {
+    while(conn->received_range_count > 0 && !seqBefore(conn->expected_next, conn->received_ranges[0].start)) {
+        uint32 end = conn->received_ranges[0].end;
+        if(seqBefore(conn->expected_next, end)) {
+            commitStaged(end - conn->expected_next);
+            conn->expected_next = end;
+        }
+        conn->received_range_count--;
+        memmove(&conn->received_ranges[0], &conn->received_ranges[1], conn->received_range_count * sizeof(sack_block_t));
+    }
+}
+
+// acks expected_next, listing the first few out of order ranges we hold
+void sendAck(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    cancelAck(conn);
+    conn->unacked_segments = 0;
+    acks_sent++;
+    header_t resp = {0};
+    resp.type = TYPE_ACK;
+    resp.sequence_number = 0;
+    resp.ack_number = conn->expected_next;
+    resp.payload_size = 0;
+    conn->window_size = receiveWindow(conn);
+    resp.window_size = conn->window_size;
+    histogramRecord(&window_histogram, resp.window_size);
+    int32 blocks = conn->received_range_count < MAX_SACK_BLOCKS ? conn->received_range_count : MAX_SACK_BLOCKS;
+    uint8 options[MAX_OPTIONS_LENGTH];
+    if(blocks > 0) {
+        resp.type |= TYPE_SACK;
+        options[0] = OPTION_SACK;
+        options[1] = 2 + blocks * 8;
+        int32 i;
+        for(i = 0; i < blocks; i++) {
+            putUint32(options + 2 + i * 8, conn->received_ranges[i].start);
+            putUint32(options + 6 + i * 8, conn->received_ranges[i].end);
+        }
+        resp.options = options;
+        resp.options_length = options[1];
+    }
+    writeHeader(&resp, buffer, buffer_index);
+    logPacket(&resp, 1);
+    flushOut(sock, buffer, buffer_index, sa, sa_size);
+    // with the ring filling up the sender may stop for the window, and then
+    // nothing comes in to ack. An update goes out once the writer makes room
+    if(conn->window_size < conn->staging_length / 2) {
+        scheduleAck(conn);
+    }
+}
+
+// turns a SYN away
+void sendReset(header_t *hdr, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    header_t resp = {0};
+    resp.type = TYPE_RST;
+    resp.sequence_number = 0;
+    resp.ack_number = hdr->sequence_number;
+    resp.payload_size = 0;
+    resp.window_size = 0;
+    writeHeader(&resp, buffer, buffer_index);
+    logPacket(&resp, 1);
+    flushOut(sock, buffer, buffer_index, sa, sa_size);
+}
+
+// acks the flow's FIN and sends our own
+void sendFinAck(connection_t *c, int32 sock, uint8 *buffer, int32 *buffer_index) {
+    {
+        header_t resp = {0};
+        resp.type = TYPE_ACK;
+        resp.sequence_number = 0;
+        resp.ack_number = c->fin_seq + 1;
+        resp.payload_size = 0;
+        resp.window_size = receiveWindow(c);
+        writeHeader(&resp, buffer, buffer_index);
+        logPacket(&resp, 1);
+        flushOut(sock, buffer, buffer_index, (struct sockaddr*) &c->addr, sizeof(struct sockaddr_in));
+    }
+    {
+        header_t resp = {0};
+        resp.type = TYPE_FIN;
+        resp.sequence_number = c->fin_seq + 1;
+        c->pending_syn = resp.sequence_number;
+        resp.ack_number = 0;
+        resp.payload_size = 0;
+        resp.window_size = receiveWindow(c);
+        writeHeader(&resp, buffer, buffer_index);
+        logPacket(&resp, 1);
+        flushOut(sock, buffer, buffer_index, (struct sockaddr*) &c->addr, sizeof(struct sockaddr_in));
+    }
+    c->state = STATE_FIN;
+}
+
+// the sender only hears that its range is in once every range of the file
+// is, so a transfer is never confirmed with part of it missing
+void finishTransfer(transfer_t *t, int32 sock, uint8 *buffer, int32 *buffer_index) {
+    int32 i;
+    for(i = 0; i < CONNECTION_BUCKETS; i++) {
+        connection_t *c;
+        for(c = connection_table[i]; c != NULL; c = c->next) {
+            if(c->transfer == t && c->state == STATE_FIN_WAIT) {
+                memcpy(&receiver_addr, &c->addr, sizeof receiver_addr);
+                sendFinAck(c, sock, buffer, buffer_index);
+            }
+        }
+    }
+}
+
+void receiveData(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(hdr->sequence_number != conn->expected_next) {
+        if(seqBefore(hdr->sequence_number, conn->expected_next)) {
+            duplicate_packets++;
+        } else {
+            out_of_order_packets++;
+        }
+        LOG(LOG_EVENT, "Packet LOSS! got %u but expected %u\n", hdr->sequence_number, conn->expected_next);
+        storeOutOfOrder(hdr, payload);
+        sendAck(sock, buffer, buffer_index, sa, sa_size);
+        return;
+    }
+    int32 filling_gap = conn->received_range_count > 0;
+    stageData(payload, hdr->payload_size);
+    conn->expected_next = hdr->sequence_number + hdr->payload_size;
+    deliverReassembled();
+
+    // acks are cumulative, ack_number is the next byte we expect
+    if(filling_gap || ++conn->unacked_segments >= ack_every) {
+        sendAck(sock, buffer, buffer_index, sa, sa_size);
+    } else {
+        scheduleAck(conn);
+    }
+}
+
+// GF(256) arithmetic for FEC parity, modulo the polynomial 0x11d. Adding is
+// XOR and multiplying goes through log and exp tables. The bulk of the work is
+// dst ^= c * src over a whole segment, which the AVX2 and SSSE3 kernels do 32
+// or 16 bytes at a time by looking up c times each nibble with a shuffle
+#define GF_POLYNOMIAL 0x11d
+
+uint8 gf_exp[512];
+uint8 gf_log[256];
+uint8 gf_mul_table[256][256];
+// c times every low nibble and every high nibble, for the shuffles
+uint8 gf_mul_low[256][16];
+uint8 gf_mul_high[256][16];
+
+uint8 gfMul(uint8 a, uint8 b) {
+    if(a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8 gfInv(uint8 a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+void gfMulAddScalar(uint8 *dst, uint8 *src, uint8 c, int32 len) {
+    int32 i;
+    if(c == 0) {
+        return;
+    }
+    if(c == 1) {
+        for(i = 0; i < len; i++) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    uint8 *row = gf_mul_table[c];
+    for(i = 0; i < len; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+void gfMulAddSsse3(uint8 *dst, uint8 *src, uint8 c, int32 len) {
+    if(c == 0) {
+        return;
+    }
+    __m128i low = _mm_loadu_si128((__m128i *) gf_mul_low[c]);
+    __m128i high = _mm_loadu_si128((__m128i *) gf_mul_high[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int32 i;
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((__m128i *) (src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(s, mask)),
+            _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void gfMulAddAvx2(uint8 *dst, uint8 *src, uint8 c, int32 len) {
+    if(c == 0) {
+        return;
+    }
+    // the shuffle looks up within each 128 bit lane, so both lanes get the table
+    __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) gf_mul_low[c]));
+    __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) gf_mul_high[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int32 i;
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i *) (src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(s, mask)),
+            _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        __m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+void (*gfMulAdd)(uint8 *dst, uint8 *src, uint8 c, int32 len) = gfMulAddScalar;
+
+void gfInit() {
+    int32 x = 1;
+    int32 i;
+    for(i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if(x & 0x100) {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+    for(i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    int32 c;
+    for(c = 0; c < 256; c++) {
+        for(i = 0; i < 256; i++) {
+            gf_mul_table[c][i] = gfMul(c, i);
+        }
+        for(i = 0; i < 16; i++) {
+            gf_mul_low[c][i] = gf_mul_table[c][i];
+            gf_mul_high[c][i] = gf_mul_table[c][i << 4];
+        }
+    }
+    char *kernel = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        gfMulAdd = gfMulAddAvx2;
+        kernel = "AVX2";
+    } else if(__builtin_cpu_supports("ssse3")) {
+        gfMulAdd = gfMulAddSsse3;
+        kernel = "SSSE3";
+    }
+#endif
+    LOG(LOG_INFO, "FEC arithmetic uses %s kernels\n", kernel);
+}
+
+// a block of up to FEC_MAX_DATA DAT packets gets up to FEC_MAX_PARITY FEC
+// packets, and the receiver rebuilds as many lost DAT packets as FEC packets
+// arrived. One FEC packet is the XOR of the block. More are Reed-Solomon rows
+// of a Cauchy matrix, 1 / (j ^ (FEC_MAX_PARITY + i)) for FEC packet j and DAT
+// packet i, any square part of which can be inverted
+#define FEC_MAX_DATA 32
+#define FEC_MAX_PARITY 4
+#define FEC_MAX_SEGMENT 9000
+
+uint8 fecCoefficient(int32 parity, int32 j, int32 i) {
+    return parity == 1 ? 1 : gfInv(j ^ (FEC_MAX_PARITY + i));
+}
+
+// the missing packets' share of each FEC packet, then room for one packet
+uint8 *fec_scratch;
+uint64 fec_recovered;
+
+void fecInit() {
+    gfInit();
+    fec_scratch = malloc((FEC_MAX_PARITY + 1) * FEC_MAX_SEGMENT);
+    if(fec_scratch == NULL) {
+        fprintf(stderr, "Failed to allocate FEC buffers\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int32 fecSegmentLength(fec_block_t *b, int32 i) {
+    return i == b->count - 1 ? b->last_size : b->segment_size;
+}
+
+// whether all of start to end is in, in order or stored ahead
+int32 haveData(uint32 start, uint32 end) {
+    if(!seqBefore(conn->expected_next, end)) {
+        return 1;
+    }
+    int32 i;
+    for(i = 0; i < conn->received_range_count; i++) {
+        if(!seqBefore(start, conn->received_ranges[i].start) && !seqBefore(conn->received_ranges[i].end, end)) {
             return 1;
         }
-        buffer_index += recsize;
-        if(buffer_index >= HEADER_LENGTH) {
-            header_t *hdr = (header_t*) packet_buffer;
-            int32 full_packet_size =  hdr->payload_size + HEADER_LENGTH;
-            if(buffer_index >= full_packet_size) {
-                readPacket(hdr, packet_buffer + HEADER_LENGTH, s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen);
-                int32 nbuffer_index = buffer_index - full_packet_size;
-                if(nbuffer_index > 0) {
-                    memcpy(packet_buffer, packet_buffer + full_packet_size, nbuffer_index);
+    }
+    return 0;
+}
+
+// copies out data that is offset bytes past expected_next, or before it for
+// a negative offset, as long as the ring hasn't come round over it since
+void copyFromStaging(int64 offset, uint8 *data, int32 len) {
+    uint64 pos = (conn->staged + offset) % conn->staging_length;
+    int32 first = len < conn->staging_length - pos ? len : conn->staging_length - pos;
+    memcpy(data, conn->staging + pos, first);
+    memcpy(data + first, conn->staging, len - first);
+}
+
+// inverts the n by n matrix a, which is left as the identity. Returns 0 if it
+// can't be inverted
+int32 gfInvertMatrix(uint8 a[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8 inverse[FEC_MAX_PARITY][FEC_MAX_PARITY], int32 n) {
+    int32 row;
+    int32 col;
+    int32 k;
+    for(row = 0; row < n; row++) {
+        for(k = 0; k < n; k++) {
+            inverse[row][k] = row == k;
+        }
+    }
+    for(col = 0; col < n; col++) {
+        int32 pivot = col;
+        while(pivot < n && a[pivot][col] == 0) {
+            pivot++;
+        }
+        if(pivot == n) {
+            return 0;
+        }
+        for(k = 0; k < n; k++) {
+            uint8 t = a[col][k];
+            a[col][k] = a[pivot][k];
+            a[pivot][k] = t;
+            t = inverse[col][k];
+            inverse[col][k] = inverse[pivot][k];
+            inverse[pivot][k] = t;
+        }
+        uint8 scale = gfInv(a[col][col]);
+        for(k = 0; k < n; k++) {
+            a[col][k] = gfMul(a[col][k], scale);
+            inverse[col][k] = gfMul(inverse[col][k], scale);
+        }
+        for(row = 0; row < n; row++) {
+            uint8 factor = a[row][col];
+            if(row == col || factor == 0) {
+                continue;
+            }
+            for(k = 0; k < n; k++) {
+                a[row][k] ^= gfMul(factor, a[col][k]);
+                inverse[row][k] ^= gfMul(factor, inverse[col][k]);
+            }
+        }
+    }
+    return 1;
+}
+
+// rebuilds the missing DAT packets of a block once there are as many FEC
+// packets as missing ones, and takes them in as if they had arrived. Returns
+// 1 once the block needs nothing more
+int32 recoverBlock(fec_block_t *b, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    int32 missing[FEC_MAX_PARITY];
+    int32 missing_count = 0;
+    int32 i;
+    for(i = 0; i < b->count; i++) {
+        uint32 start = b->start + i * b->segment_size;
+        if(!haveData(start, start + fecSegmentLength(b, i))) {
+            if(missing_count == b->parity) {
+                // more lost than there is parity for, it's up to the retransmits
+                return 0;
+            }
+            missing[missing_count++] = i;
+        }
+    }
+    if(missing_count == 0) {
+        return 1;
+    }
+    int32 rows[FEC_MAX_PARITY];
+    int32 row_count = 0;
+    int32 j;
+    for(j = 0; j < b->parity && row_count < missing_count; j++) {
+        if(b->received & (1 << j)) {
+            rows[row_count++] = j;
+        }
+    }
+    if(row_count < missing_count) {
+        return 0;
+    }
+    // the packets of the block already handed on are read back from the
+    // ring, which must not have come round over them for data stored ahead
+    int32 behind = (int32)(conn->expected_next - b->start);
+    uint32 ahead = conn->received_range_count > 0 ? conn->received_ranges[conn->received_range_count - 1].end - conn->expected_next : 0;
+    if(behind > 0 && (uint64) behind + ahead > conn->staging_length) {
+        return 1;
+    }
+    // take the packets that are in out of each FEC packet, what's left is
+    // the missing ones times their coefficients
+    int32 size = b->segment_size;
+    uint8 *packet = fec_scratch + FEC_MAX_PARITY * FEC_MAX_SEGMENT;
+    int32 r;
+    for(r = 0; r < row_count; r++) {
+        memcpy(fec_scratch + r * FEC_MAX_SEGMENT, b->data + rows[r] * size, size);
+    }
+    int32 m = 0;
+    for(i = 0; i < b->count; i++) {
+        if(m < missing_count && missing[m] == i) {
+            m++;
+            continue;
+        }
+        int32 len = fecSegmentLength(b, i);
+        copyFromStaging((int32)(b->start + i * size - conn->expected_next), packet, len);
+        for(r = 0; r < row_count; r++) {
+            gfMulAdd(fec_scratch + r * FEC_MAX_SEGMENT, packet, fecCoefficient(b->parity, rows[r], i), len);
+        }
+    }
+    uint8 coefficients[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    uint8 inverse[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    for(r = 0; r < row_count; r++) {
+        for(m = 0; m < missing_count; m++) {
+            coefficients[r][m] = fecCoefficient(b->parity, rows[r], missing[m]);
+        }
+    }
+    if(!gfInvertMatrix(coefficients, inverse, missing_count)) {
+        return 1;
+    }
+    for(m = 0; m < missing_count; m++) {
+        memset(packet, 0, size);
+        for(r = 0; r < row_count; r++) {
+            gfMulAdd(packet, fec_scratch + r * FEC_MAX_SEGMENT, inverse[m][r], size);
+        }
+        header_t hdr = {0};
+        hdr.type = TYPE_DAT;
+        hdr.sequence_number = b->start + missing[m] * size;
+        hdr.payload_size = fecSegmentLength(b, missing[m]);
+        LOG(LOG_EVENT, "Rebuilt packet %u from FEC\n", hdr.sequence_number);
+        fec_recovered++;
+        receiveData(&hdr, packet, sock, buffer, buffer_index, sa, sa_size);
+    }
+    return 1;
+}
+
+void freeBlock(fec_block_t *b) {
+    free(b->data);
+    b->data = NULL;
+    b->count = 0;
+    conn->fec_pending--;
+}
+
+// tries every held block again, after more of the data or parity came in
+void recoverBlocks(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    int32 i;
+    for(i = 0; i < FEC_PENDING_BLOCKS; i++) {
+        fec_block_t *b = &conn->fec_blocks[i];
+        if(b->count > 0 && recoverBlock(b, sock, buffer, buffer_index, sa, sa_size)) {
+            freeBlock(b);
+        }
+    }
+}
+
+void receiveParity(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    int32 len;
+    uint8 *option = findOption(hdr, OPTION_FEC, &len);
+    if(option == NULL || len != FEC_OPTION_LENGTH - 2) {
+        return;
+    }
+    int32 count = option[0];
+    int32 parity = option[1];
+    int32 index = option[2];
+    int32 last_size = getUint16(option + 4);
+    int32 size = hdr->payload_size;
+    if(count < 1 || count > FEC_MAX_DATA || parity < 1 || parity > FEC_MAX_PARITY || index >= parity
+        || size > FEC_MAX_SEGMENT || last_size < 1 || last_size > size) {
+        LOG(LOG_EVENT, "Dropping malformed FEC packet\n");
+        return;
+    }
+    uint32 start = hdr->sequence_number;
+    uint32 end = start + (count - 1) * size + last_size;
+    if(!seqBefore(conn->expected_next, start) && !seqBefore(conn->expected_next, end)) {
+        return;
+    }
+    if(conn->fec_blocks == NULL) {
+        conn->fec_blocks = calloc(FEC_PENDING_BLOCKS, sizeof(fec_block_t));
+        if(conn->fec_blocks == NULL) {
+            return;
+        }
+    }
+    fec_block_t *b = NULL;
+    fec_block_t *free_slot = NULL;
+    int32 i;
+    for(i = 0; i < FEC_PENDING_BLOCKS; i++) {
+        fec_block_t *slot = &conn->fec_blocks[i];
+        if(slot->count > 0 && slot->start == start) {
+            b = slot;
+        } else if(slot->count == 0 && free_slot == NULL) {
+            free_slot = slot;
+        }
+    }
+    if(b == NULL) {
+        if(free_slot == NULL) {
+            LOG(LOG_EVENT, "No room for the FEC block at %u\n", start);
+            return;
+        }
+        b = free_slot;
+        b->data = malloc(parity * size);
+        if(b->data == NULL) {
+            return;
+        }
+        b->start = start;
+        b->count = count;
+        b->parity = parity;
+        b->segment_size = size;
+        b->last_size = last_size;
+        b->received = 0;
+        conn->fec_pending++;
+    } else if(b->count != count || b->parity != parity || b->segment_size != size) {
+        return;
+    }
+    memcpy(b->data + index * size, payload, size);
+    b->received |= 1 << index;
+    if(recoverBlock(b, sock, buffer, buffer_index, sa, sa_size)) {
+        freeBlock(b);
+    }
+}
+
+void readPacket(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    //printf("Recieved packet type %s sequence %d ack %d payload %d window %d\n", toTypeStr(hdr->type), hdr->sequence_number, hdr->ack_number, hdr->payload_size, hdr->window_size);
+    logPacket(hdr, 0);
+    if(isPrb(hdr)) {
+        // path MTU probe, padded to the size being tried. Echo its id so the
+        // sender knows that size got through
+        if(conn->state != STATE_WAITING) {
+            header_t resp = {0};
+            resp.type = TYPE_PRB | TYPE_ACK;
+            resp.sequence_number = 0;
+            resp.ack_number = hdr->sequence_number;
+            resp.payload_size = 0;
+            resp.window_size = receiveWindow(conn);
+            writeHeader(&resp, buffer, buffer_index);
+            logPacket(&resp, 1);
+            flushOut(sock, buffer, buffer_index, sa, sa_size);
+        }
+        return;
+    }
+    if(conn->state == STATE_WAITING && isSyn(hdr)) {
+        header_t resp = {0};
+        resp.type = TYPE_SYN | TYPE_ACK;
+        resp.sequence_number = hdr->sequence_number + 1;
+        conn->pending_syn = resp.sequence_number;
+        resp.ack_number = hdr->sequence_number;
+        resp.payload_size = 0;
+        conn->window_size = receiveWindow(conn);
+        resp.window_size = conn->window_size;
+        // the sender allows for the delay before it calls a packet lost
+        uint8 options[6];
+        options[0] = OPTION_ACK_DELAY;
+        options[1] = sizeof options;
+        putUint32(options + 2, ack_every > 1 ? ack_delay / 1000 : 0);
+        resp.options = options;
+        resp.options_length = sizeof options;
+        writeHeader(&resp, buffer, buffer_index);
+        logPacket(&resp, 1);
+        flushOut(sock, buffer, buffer_index, sa, sa_size);
+        conn->state = STATE_SYN;
+        conn->expected_next = conn->pending_syn + 1;
+        conn->syn_ack_time = getCurrentTime();
+    } else if(conn->state == STATE_SYN) {
+        if(isAck(hdr)) {
+            if(conn->pending_syn != hdr->ack_number) {
+                return;
+            }
+            conn->state = STATE_RECEIVING;
+            noteRoundTrip(conn);
+        } else if(isDat(hdr)) {
+            // the sender only sends data once it has our SYN/ACK, so its ack
+            // of it went missing
+            conn->state = STATE_RECEIVING;
+            noteRoundTrip(conn);
+            readPacket(hdr, payload, sock, buffer, buffer_index, sa, sa_size);
+        }
+    } else if(conn->state == STATE_RECEIVING) {
+        if(isDat(hdr)) {
+            receiveData(hdr, payload, sock, buffer, buffer_index, sa, sa_size);
+            if(conn->fec_pending > 0) {
+                recoverBlocks(sock, buffer, buffer_index, sa, sa_size);
+            }
+        } else if(isFec(hdr)) {
+            receiveParity(hdr, payload, sock, buffer, buffer_index, sa, sa_size);
+        } else if(isFin(hdr)) {
+            conn->fin_seq = hdr->sequence_number;
+            conn->state = STATE_FIN_WAIT;
+            transfer_t *t = conn->transfer;
+            t->flows_done++;
+            if(t->flows_done < t->flow_count) {
+                LOG(LOG_INFO, "Flow at offset %llu done, %d of %d flows in\n", conn->base_offset, t->flows_done, t->flow_count);
+                return;
+            }
+            finishTransfer(t, sock, buffer, buffer_index);
+        }
+    } else if(conn->state == STATE_FIN) {
+        if(isAck(hdr)) {
+            if(hdr->ack_number != conn->pending_syn) {
+                return;
+            }
+            flushQueue(sock);
+            finishConnection(conn, 0);
+            conn = NULL;
+            if(server_mode || connection_count > 0) {
+                return;
+            }
+#ifdef SIMULATION
+            simFinished(SIM_RECEIVER);
+            return;
+#endif
+            stopWriter();
+            printBatchStats(total_written);
+            if(gro_datagrams > 0) {
+                LOG(LOG_INFO, "UDP GRO: %llu packets received in %llu coalesced datagrams\n", gro_packets, gro_datagrams);
+            }
+            if(fec_recovered > 0) {
+                LOG(LOG_INFO, "Rebuilt %llu lost packets from FEC\n", fec_recovered);
+            }
+            LOG(LOG_INFO, "Kernel dropped %llu datagrams with a receive buffer of %d bytes\n", kernel_drops, receive_buffer_size);
+            close(sock);
+            exit(0);
+        }
+    }
+}
+
+void readDatagram(uint8 *packet, int32 len, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    LOG(LOG_EVENT, "Received %d\n", len);
+    header_t header;
+    header_t *hdr = &header;
+    int32 payload = readHeader(packet, len, hdr);
+    if(payload == 0) {
+        LOG(LOG_EVENT, "Dropping malformed packet of %d bytes\n", len);
+        return;
+    }
+    conn = findConnection((struct sockaddr_in*) sa);
+    if(conn == NULL) {
+        // only a SYN starts a connection
+        if(!isSyn(hdr) || isAck(hdr)) {
+            LOG(LOG_EVENT, "Dropping %s from unknown sender\n", toTypeStr(hdr->type));
+            return;
+        }
+        flow_range_t range;
+        int32 has_range = hdr->payload_size >= FLOW_RANGE_LENGTH;
+        if(has_range) {
+            range.transfer_id = getUint32(packet + payload);
+            range.flow_count = getUint32(packet + payload + 4);
+            range.offset = (uint64) getUint32(packet + payload + 8) << 32 | getUint32(packet + payload + 12);
+        }
+        conn = openConnection((struct sockaddr_in*) sa, has_range ? &range : NULL);
+        if(conn == NULL) {
+            // a flow that will never be taken is told so, or its sender keeps
+            // trying. One turned away for want of room may get in later
+            if(has_range && (!server_mode || connection_count < MAX_CONNECTIONS)) {
+                sendReset(hdr, sock, buffer, buffer_index, sa, sa_size);
+            }
+            return;
+        }
+    }
+    conn->last_heard = time(NULL);
+    if(isDat(hdr) || isFec(hdr)) {
+        tuneReceiveBuffer(sock, len);
+    }
+    readPacket(hdr, packet + payload, sock, buffer, buffer_index, sa, sa_size);
+}
+
+// sends the acks whose delay is up
+void sendDelayedAcks(int32 sock, uint8 *buffer, int32 *buffer_index) {
+    uint64 now = getCurrentTime();
+    while(delayed_acks != NULL && delayed_acks->ack_deadline <= now) {
+        conn = delayed_acks;
+        if(conn->unacked_segments == 0 && receiveWindow(conn) <= conn->window_size) {
+            // only here to reopen the window, and the writer hasn't got to it
+            cancelAck(conn);
+            scheduleAck(conn);
+            continue;
+        }
+        memcpy(&receiver_addr, &conn->addr, sizeof receiver_addr);
+        sendAck(sock, buffer, buffer_index, (struct sockaddr*) &conn->addr, sizeof(struct sockaddr_in));
+    }
+}
+
+// ms the main loop may wait before the next delayed ack is due
+int32 ackWait() {
+    if(delayed_acks == NULL) {
+        return 1000;
+    }
+    uint64 now = getCurrentTime();
+    if(delayed_acks->ack_deadline <= now) {
+        return 0;
+    }
+    uint64 wait = (delayed_acks->ack_deadline - now + 999999) / 1000000;
+    return wait < 1000 ? wait : 1000;
+}
+
+// binds the receiving socket, returns it or -1
+int32 openSocket(struct sockaddr_in *sa, int32 reuse_port) {
+    int32 s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == -1) {
+        fprintf(stderr, "Failed to create socket\n");
+        fprintf(stderr, "%s\n", strerror(errno));
+        return -1;
+    }
+    int32 opt = 1;
+    if(reuse_port && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) != 0) {
+        fprintf(stderr, "Failed to share the port: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+    if (bind(s, (struct sockaddr *)sa, sizeof(struct sockaddr_in)) == -1) {
+        fprintf(stderr, "Failed to bind port\n");
+        fprintf(stderr, "%s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+    setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof opt);
+    socklen_t len = sizeof receive_buffer_size;
+    getsockopt(s, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, &len);
+    receive_buffer_size /= 2;
+    if(server_mode) {
+        // every sender shares this socket's receive queue
+        growSocketBuffer(s, SO_RCVBUF, SO_RCVBUFFORCE, &receive_buffer_size, SERVER_RECEIVE_BUFFER);
+    }
+    return s;
+}
+
+// with -w the server runs as that many worker processes, each with its own
+// SO_REUSEPORT socket on the same port and its own connections, so nothing
+// is shared between them. The kernel keeps a flow on one worker by hashing
+// its addresses, with -B a CBPF program picks the worker from the sender's
+// address alone instead, which holds even as workers come and go. Only -B
+// keeps the flows of a multi-flow transfer together, without it a flow that
+// lands on a different worker from the first is turned away
+#define MAX_WORKERS 64
+
+int32 steer_workers;
+
+// attaches the steering program to the port's reuseport group
+int32 attachSteering(int32 sock, int32 workers) {
+    struct sock_filter code[] = {
+        // ipv4 source address, not the port, since the flows of a transfer
+        // come from consecutive ports and must all reach the same worker
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers },
+        // index of the socket in the group, in the order they were bound
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof code / sizeof code[0];
+    prog.filter = code;
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+}
+
+// binds a socket per worker and forks them. Returns the socket of the worker
+// this process became, the parent only returns if setting up failed
+int32 startWorkers(struct sockaddr_in *sa) {
+    int32 socks[MAX_WORKERS];
+    int32 i;
+    for(i = 0; i < worker_count; i++) {
+        socks[i] = openSocket(sa, 1);
+        if(socks[i] < 0) {
+            return -1;
+        }
+    }
+    if(steer_workers && attachSteering(socks[0], worker_count) != 0) {
+        fprintf(stderr, "Can't attach the steering program (%s), leaving it to the kernel's hash\n", strerror(errno));
+    }
+    fflush(stdout);
+    for(i = 0; i < worker_count; i++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Failed to start worker %d: %s\n", i, strerror(errno));
+            return -1;
+        }
+        if(pid == 0) {
+            // workers go when the parent does
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            int32 j;
+            for(j = 0; j < worker_count; j++) {
+                if(j != i) {
+                    close(socks[j]);
+                }
+            }
+            worker_id = i;
+            LOG(LOG_INFO, "Worker %d receiving\n", i);
+            return socks[i];
+        }
+    }
+    for(i = 0; i < worker_count; i++) {
+        close(socks[i]);
+    }
+    int32 status;
+    pid_t pid;
+    while((pid = wait(&status)) > 0 || errno == EINTR) {
+        if(pid > 0) {
+            LOG(LOG_INFO, "Worker process %d exited with status %d\n", pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+    }
+    exit(0);
+}
+
+// with -j the metrics go to stderr as a JSON line every so many seconds and
+// once more at exit, and with -u a Unix socket hands the same line to anyone
+// who connects, e.g. socat - UNIX-CONNECT:<path>. A thread of its own does
+// both, reading the numbers without locks, so a line can mix values from
+// either side of a packet
+#define METRICS_LINE_LENGTH 4096
+
+int32 metrics_interval;
+char *stats_path;
+int stats_fd = -1;
+uint64 metrics_start;
+pthread_t metrics_thread;
+
+// the numbers behind -j and -u, as one JSON line
+int32 formatMetrics(char *buf, int32 len) {
+    double seconds = (getCurrentTime() - metrics_start) / 1000000000.0;
+    int32 n = snprintf(buf, len, "{\"t\":%.3f,\"worker\":%d,\"connections\":%d,\"connections_finished\":%llu,\"bytes_received\":%llu,\"goodput_mbps\":%.3f,"
+        "\"bytes_written\":%llu,\"out_of_order\":%llu,\"duplicates\":%llu,\"staging_stalls\":%llu,\"datagrams_received\":%llu,\"acks_sent\":%llu,"
+        "\"kernel_drops\":%llu,\"receive_buffer\":%d,\"fec_recovered\":%llu",
+        seconds, worker_id, connection_count, connections_finished, received_bytes, seconds > 0 ? received_bytes * 8 / seconds / 1000000 : 0,
+        total_written, out_of_order_packets, duplicate_packets, staging_stalls, received_datagrams, acks_sent, kernel_drops, receive_buffer_size, fec_recovered);
+    n += histogramJson(buf + n, len - n, "window_bytes", &window_histogram);
+    n += histogramJson(buf + n, len - n, "disk_write_us", &disk_write_histogram);
+    n += snprintf(buf + n, len - n, "}\n");
+    return n;
+}
+
+void *metricsMain(void *arg) {
+    char line[METRICS_LINE_LENGTH];
+    uint64 next_report = getCurrentTime() + (uint64) metrics_interval * 1000000000;
+    while(1) {
+        int timeout = -1;
+        if(metrics_interval > 0) {
+            uint64 now = getCurrentTime();
+            timeout = next_report > now ? (next_report - now) / 1000000 + 1 : 0;
+        }
+        struct pollfd pfd = {stats_fd, POLLIN, 0};
+        int32 ready = poll(&pfd, stats_fd >= 0 ? 1 : 0, timeout);
+        if(ready > 0 && (pfd.revents & POLLIN)) {
+            int client = accept(stats_fd, NULL, NULL);
+            if(client >= 0) {
+                int32 len = formatMetrics(line, sizeof line);
+                if(write(client, line, len) < 0) {
+                    // the client went away, nothing to do about it
                 }
-                buffer_index = nbuffer_index;
+                close(client);
+            }
+        }
+        if(metrics_interval > 0 && getCurrentTime() >= next_report) {
+            formatMetrics(line, sizeof line);
+            fputs(line, stderr);
+            next_report += (uint64) metrics_interval * 1000000000;
+        }
+    }
+    return NULL;
+}
+
+void stopMetrics() {
+    if(metrics_interval > 0) {
+        char line[METRICS_LINE_LENGTH];
+        formatMetrics(line, sizeof line);
+        fputs(line, stderr);
+    }
+    if(stats_fd >= 0) {
+        unlink(stats_path);
+    }
+}
+
+void startMetrics(char *path) {
+    metrics_start = getCurrentTime();
+    if(path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if(strlen(path) >= sizeof addr.sun_path) {
+            fprintf(stderr, "Stats socket path %s is too long\n", path);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, path);
+        stats_path = strdup(path);
+        // a socket left behind by an earlier run is in the way
+        unlink(path);
+        stats_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(stats_fd < 0 || bind(stats_fd, (struct sockaddr*) &addr, sizeof addr) != 0 || listen(stats_fd, 16) != 0) {
+            fprintf(stderr, "Can't open the stats socket %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(stats_fd < 0 && metrics_interval == 0) {
+        return;
+    }
+    if(pthread_create(&metrics_thread, NULL, metricsMain, NULL) != 0) {
+        fprintf(stderr, "Failed to start the metrics thread\n");
+        exit(EXIT_FAILURE);
+    }
+    atexit(stopMetrics);
+}
+
+#ifdef SIMULATION
+// the simulated network has no addresses, this stands in for the sender's
+struct sockaddr_in sim_peer;
+uint8 sim_buffer[PACKET_BUFFER_LENGTH];
+int32 sim_index;
+
+SIM_EXPORT void rdprSimStart(int32 level, int32 every, uint64 delay) {
+    log_level = level;
+    ack_every = every;
+    ack_delay = delay;
+    output_name = "simulated";
+    sim_peer.sin_family = AF_INET;
+    batch_size = DEFAULT_BATCH_SIZE;
+    initBatches(batch_size);
+    fecInit();
+}
+
+SIM_EXPORT void rdprSimReceive(uint8 *packet, int32 len) {
+    received_datagrams++;
+    memcpy(&receiver_addr, &sim_peer, sizeof receiver_addr);
+    readDatagram(packet, len, -1, sim_buffer, &sim_index, (struct sockaddr*) &sim_peer, sizeof sim_peer);
+    flushQueue(-1);
+}
+
+// when the next delayed ack is due, 0 if none is waiting
+SIM_EXPORT uint64 rdprSimNextWake() {
+    return delayed_acks != NULL ? delayed_acks->ack_deadline : 0;
+}
+
+SIM_EXPORT void rdprSimWake() {
+    sendDelayedAcks(-1, sim_buffer, &sim_index);
+    flushQueue(-1);
+}
+
+SIM_EXPORT int32 rdprSimMetrics(char *buf, int32 len) {
+    return formatMetrics(buf, len);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    batch_size = DEFAULT_BATCH_SIZE;
+    char *trace_path = NULL;
+    char *stats_socket = NULL;
+    int32 opt;
+    while((opt = getopt(argc, argv, "a:b:Bfgj:st:u:v:w:")) != -1) {
+        if(opt == 'a') {
+            // segments[,delay_ms]
+            ack_every = atoi(optarg);
+            char *delay = strchr(optarg, ',');
+            if(delay != NULL) {
+                ack_delay = atof(delay + 1) * 1000000;
             }
+            if(ack_every < 1 || ack_every > MAX_ACK_EVERY || ack_delay < 1000 || ack_delay > MAX_ACK_DELAY) {
+                fprintf(stderr, "Acks must be every 1 to %d segments, with a delay of 0.001 to %llums.\n", MAX_ACK_EVERY, MAX_ACK_DELAY / 1000000);
+                return 1;
+            }
+        } else if(opt == 'g') {
+            use_gro = 1;
+        } else if(opt == 'f') {
+            preallocate = 1;
+        } else if(opt == 's') {
+            server_mode = 1;
+        } else if(opt == 'w') {
+            worker_count = atoi(optarg);
+            if(worker_count < 1 || worker_count > MAX_WORKERS) {
+                fprintf(stderr, "Workers must be between 1 and %d.\n", MAX_WORKERS);
+                return 1;
+            }
+        } else if(opt == 'B') {
+            steer_workers = 1;
+        } else if(opt == 'v') {
+            log_level = atoi(optarg);
+        } else if(opt == 't') {
+            trace_path = optarg;
+        } else if(opt == 'j') {
+            metrics_interval = atoi(optarg);
+            if(metrics_interval < 1) {
+                fprintf(stderr, "Metrics interval must be at least a second.\n");
+                return 1;
+            }
+        } else if(opt == 'u') {
+            stats_socket = optarg;
+        } else if(opt == 'b') {
+            batch_size = atoi(optarg);
+            if(batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+                fprintf(stderr, "Batch size must be between 1 and %d.\n", MAX_BATCH_SIZE);
+                return 1;
+            }
+        } else {
+            argc = 0;
+        }
+    }
+    if(log_level < LOG_PACKET) {
+        // with nothing printed per packet, lines can go out as they are
+        // written and aren't lost if the process is killed
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    if(argc - optind != 3) {
+        printf("Usage: ./rdpr [-a segments[,delay_ms]] [-b batch] [-f] [-g] [-j seconds] [-s [-w workers [-B]]] [-t trace_file] [-u stats_socket] [-v level] <reciever_ip> <reciever_port> <output_file>\n");
+        return 0;
+    }
+    if(worker_count > 1 && !server_mode) {
+        fprintf(stderr, "Workers only make sense with -s.\n");
+        return 1;
+    }
+    argv += optind;
+    sender_port = atoi(argv[1]);
+    sender_ip = argv[0];
+    output_name = argv[2];
+
+    if(server_mode) {
+        LOG(LOG_INFO, "Starting RDP reciever on port %s:%d outputting to %s.<sender ip>.<sender port>\n", sender_ip, sender_port, output_name);
+    } else {
+        LOG(LOG_INFO, "Starting RDP reciever on port %s:%d outputting to %s\n", sender_ip, sender_port, output_name);
+    }
+
+    struct sockaddr_in sa;
+    socklen_t fromlen;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = inet_addr(sender_ip);
+    sa.sin_port = htons(sender_port);
+    fromlen = sizeof(sa);
+    int32 s = worker_count > 1 ? startWorkers(&sa) : openSocket(&sa, 0);
+    if(s < 0) {
+        return 1;
+    }
+    // threads don't survive fork, so the writer and the trace start in each
+    // worker, each worker tracing to a file of its own
+    startWriter();
+    if(trace_path != NULL) {
+        char path[4096];
+        if(worker_count > 1) {
+            snprintf(path, sizeof path, "%s.%d", trace_path, worker_id);
+        } else {
+            snprintf(path, sizeof path, "%s", trace_path);
+        }
+        startTrace(path, sender_ip, sender_port);
+    }
+    if(stats_socket != NULL && worker_count > 1) {
+        char path[4096];
+        snprintf(path, sizeof path, "%s.%d", stats_socket, worker_id);
+        startMetrics(path);
+    } else {
+        startMetrics(stats_socket);
+    }
+
+    uint8 output_buffer[PACKET_BUFFER_LENGTH];
+    int32 output_index = 0;
+    initBatches(batch_size);
+    initControls();
+    fecInit();
+    if(use_gro) {
+        initGro(s);
+    }
+    int32 ep = epoll_create1(0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = s;
+    if(ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) != 0) {
+        fprintf(stderr, "Failed to set up epoll: %s\n", strerror(errno));
+        return 1;
+    }
+    while (1) {
+        struct epoll_event events[1];
+        int32 ready = epoll_wait(ep, events, 1, ackWait());
+        if(ready < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s\n", strerror(errno));
+            return 1;
+        }
+        if(ready > 0) {
+            // drain everything that is waiting before going back to epoll
+            int32 received;
+            do {
+                received = receiveBatch(s, MSG_DONTWAIT);
+                if(received < 0) {
+                    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                        break;
+                    }
+                    fprintf(stderr, "%s\n", strerror(errno));
+                    return 1;
+                }
+                int32 i;
+                for(i = 0; i < received; i++) {
+                    memcpy(&sa, &recv_addrs[i], sizeof sa);
+                    memcpy(&receiver_addr, &sa, sizeof receiver_addr);
+                    // split coalesced datagrams back into the packets they were sent as
+                    uint8 *packet = recv_iovs[i].iov_base;
+                    int32 len = recv_msgs[i].msg_len;
+                    int32 segment = groSegmentSize(i);
+                    int32 offset;
+                    for(offset = 0; offset < len; offset += segment) {
+                        readDatagram(packet + offset, len - offset < segment ? len - offset : segment, s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen);
+                    }
+                }
+            } while(received == batch_size);
+        }
+        sendDelayedAcks(s, output_buffer, &output_index);
+        flushQueue(s);
+        if(server_mode) {
+            dropIdleConnections();
         }
     }
     close(s);
@@ -1,28 +1,62 @@
-
+// for sendmmsg and recvmmsg
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 /*
 TODO:
 - add some error handling for unexpected packets in states
 - randomize initial sequence number
 - handle connection resets?
-- support selective acknoledgement
-- congestion control?
 */
 
 // guarenteed larger than the largest possible packet
-#define PACKET_BUFFER_LENGTH 65535 + 256
+#define PACKET_BUFFER_LENGTH (65535 + 256)
+// how long select waits when nothing is waiting to be retransmitted
 #define TIMEOUT_USEC 100000
+// path MTU assumed unless -M says otherwise
+#define DEFAULT_PATH_MTU 1500
+// smallest and largest path MTUs accepted or probed for
+#define MIN_PATH_MTU 576
+#define MAX_PATH_MTU 9000
+// ipv4, udp and rdp headers in front of every payload
+#define PACKET_OVERHEAD (20 + 8 + HEADER_LENGTH)
+// sequence numbers are 32 bits, so no more than half the space may be in flight
+#define MAX_SEQUENCE_WINDOW 0x7fffffff
+// duplicate acks received before the oldest packet is assumed lost
+#define DUP_ACK_THRESHOLD 3
 
 typedef unsigned char uint8;
 typedef char int8;
@@ -38,16 +72,99 @@ typedef long long int64;
 #define TYPE_SYN 4
 #define TYPE_FIN 8
 #define TYPE_RST 16
+#define TYPE_SACK 32
+#define TYPE_PRB 64
+// parity for a block of DAT packets, see fecClose
+#define TYPE_FEC 128
+
+// every packet starts with HEADER_LENGTH bytes in network byte order, then
+// the options and then the payload:
+//
+//    0  version    1  type    2  options length / 4    3  unused
+//    4  sequence number
+//    8  ack number
+//   12  window size
+//   16  payload size          18  unused
+//
+// An option is a kind byte, a length byte counting the kind, the length and
+// the data, then the data. They are padded with OPTION_END to a multiple of
+// 4 and kinds a peer doesn't know are skipped, so more can be added later
+#define HEADER_LENGTH 20
+// the header before this had no version and started with the type, and no
+// type ever sent was 3, so an old packet is never read as a new one
+#define HEADER_VERSION 3
+#define MAX_OPTIONS_LENGTH 40
+#define OPTION_END 0
+// the ranges received beyond ack_number, as 32 bit start and end pairs
+#define OPTION_SACK 1
+// on the SYN/ACK, the longest the receiver holds back an ack, 32 bit us
+#define OPTION_ACK_DELAY 2
+// on a FEC packet, the block it covers: the number of DAT packets, the number
+// of FEC packets, this one's index among them, a zero byte and the length of
+// the last DAT packet (16 bit). The sequence number is the block's first byte
+// and every DAT packet but the last is payload size long
+#define OPTION_FEC 3
+#define FEC_OPTION_LENGTH 8
 
+// a header as read off or about to go on the wire
 typedef struct header {
     uint8 type;
-    uint16 sequence_number;
-    uint16 ack_number;
     uint16 payload_size;
-    uint16 window_size;
+    uint32 sequence_number;
+    uint32 ack_number;
+    uint32 window_size;
+    uint8 *options;
+    int32 options_length;
 } header_t;
 
-#define HEADER_LENGTH 10
+// -v picks how much is printed. Errors always go to stderr
+#define LOG_QUIET 0
+// what a run did: start up, connections, summaries
+#define LOG_INFO 1
+// losses, timeouts and other per packet events
+#define LOG_EVENT 2
+// every packet sent and received, as text
+#define LOG_PACKET 3
+
+int32 log_level = LOG_INFO;
+
+#define LOG(level, ...) do { if(log_level >= (level)) { printf(__VA_ARGS__); } } while(0)
+
+// a range of sequence numbers received beyond ack_number, read from the
+// OPTION_SACK of an ack
+typedef struct sack_block {
+    uint32 start;
+    uint32 end;
+} sack_block_t;
+
+#define MAX_SACK_BLOCKS 4
+
+// with -k the file is split into ranges, each sent over a flow of its own.
+// The SYN of every flow carries one of these so the receiver can put the
+// flow's data in the right place of the one output file
+typedef struct flow_range {
+    uint32 transfer_id;
+    uint32 flow_count;
+    uint64 offset;
+} flow_range_t;
+
+// on the wire the three fields in network byte order, offset high word first
+#define FLOW_RANGE_LENGTH 16
+
+#define MAX_FLOWS 64
+
+#ifdef SIMULATION
+// rdpsim runs this file and rdpr.c in one process. The clock, the network and
+// the input file are its, and it drives the sender through the rdpsSim
+// functions below instead of main's loop. Everything else is made local to
+// this file when it is built for the simulator, see the Makefile
+#define SIM_SENDER 0
+#define SIM_EXPORT __attribute__((visibility("default")))
+SIM_EXPORT uint64 simNow();
+SIM_EXPORT int32 simSendBatch(int32 from, struct mmsghdr *msgs, int32 count);
+SIM_EXPORT int32 simReadInput(int64 offset, uint8 *data, int32 len);
+SIM_EXPORT void simFinished(int32 endpoint);
+#endif
 
 // handshake
 #define STATE_WAITING 0
@@ -63,26 +180,105 @@ typedef struct header {
 int32 state;
 uint32 pending_syn;
 FILE *sending_file;
-int32 sending_position;
-uint16 next_seq;
-uint16 last_acked_seq;
-uint16 window_size;
+int64 sending_position;
+uint32 next_seq;
+uint32 last_acked_seq;
+uint32 window_size;
+int32 duplicate_acks;
+uint64 retransmitted_bytes;
+// -M, or the largest MTU probed for with -p
+int32 path_mtu;
+// payload of a full DAT packet, sized so the packet fits the path MTU rather
+// than the receive window, so a loss never costs more than one MTU
+int32 segment_size;
+
+// with -m the input file is mapped and packets point straight into it, so
+// neither sending nor retransmitting copies the payload
+int32 use_mmap;
+uint8 *file_map;
+int64 file_size;
+// the part of the file this flow sends. sending_position counts from
+// range_start, and a range_length of -1 runs to the end of the input
+int64 range_start;
+int64 range_length = -1;
+// a queued retransmit points at a pool buffer that an ack in the same batch
+// could release and a new packet reuse, so the queue is flushed first
+int32 queued_retransmit;
 
 char *sender_ip;
 int32 sender_port;
 char *receiver_ip;
 int32 receiver_port;
 
+// packets in flight live in a ring indexed by segment number. Segment numbers
+// count packets in the order they were first sent, so the ring is also in
+// sequence order and the oldest packet is always at first_segment
+#define MAX_SEGMENTS_IN_FLIGHT 4096
+
 typedef struct sent_packet {
-    uint16 sequence;
-    int32 file_position;
+    uint32 sequence;
+    int64 file_position;
     uint16 size;
     uint8 *data;
     uint64 sent_time;
-    struct sent_packet *next;
+    // delivery progress when this was sent, for rate samples
+    uint64 delivered;
+    uint64 delivered_time;
+    uint8 sacked;
+    uint8 retransmitted;
+    // the FEC block it is in, 0 if none covers it
+    uint32 fec_block;
+    // set once it has been left for the parity to rebuild
+    uint8 fec_waited;
+    // given up on by a timeout, not in flight until it is resent
+    uint8 lost;
+    // once sacked, a segment number no later than the next unsacked packet
+    uint32 sacked_until;
+    // retransmit deadline, 0 when no timer is armed
+    uint64 deadline;
+    struct sent_packet *timer_prev;
+    struct sent_packet *timer_next;
 } sent_packet_t;
 
-sent_packet_t *pending_packets;
+sent_packet_t sent_ring[MAX_SEGMENTS_IN_FLIGHT];
+uint32 first_segment;
+uint32 next_segment;
+// SACK loss detection state, see markHoles
+uint32 sacked_segments;
+uint32 sacked_bytes;
+uint32 hole_cursor;
+uint32 sacked_below_cursor;
+// retransmits in the order they were sent, for finding the ones lost too
+typedef struct retransmit_entry {
+    sent_packet_t *sent;
+    uint32 sequence;
+    uint64 sent_time;
+} retransmit_entry_t;
+
+retransmit_entry_t retransmit_log[MAX_SEGMENTS_IN_FLIGHT];
+uint32 retransmit_log_head;
+uint32 retransmit_log_tail;
+// latest send time of a delivered packet whose ack can't be for an older copy
+uint64 newest_delivered_sent;
+// latest send time of a delivered packet that was only sent once, and the
+// furthest one has been seen to arrive behind a packet sent after it
+uint64 newest_first_sent;
+uint64 reorder_extent;
+// a timeout gives up on everything unsacked. Those packets stop counting as
+// in flight and are resent in order ahead of new data as the window opens
+// again, none below lost_cursor is still waiting
+uint32 lost_bytes;
+uint32 lost_cursor;
+
+// retransmit deadlines are kept in a hashed timer wheel. Each slot holds the
+// packets due in one WHEEL_TICK (or whole turns of the wheel later), so
+// arming, cancelling and expiring a timer never walks the window
+#define WHEEL_TICK 100000ULL
+#define WHEEL_SLOTS 1024
+
+sent_packet_t *timer_wheel[WHEEL_SLOTS];
+uint64 wheel_occupied[WHEEL_SLOTS / 64];
+uint64 wheel_tick;
 
 char *toTypeStr(uint8 type) {
     if(type == TYPE_ACK) {
@@ -95,6 +291,14 @@ char *toTypeStr(uint8 type) {
         return "DAT";
     } else if(type == TYPE_FIN) {
         return "FIN";
+    } else if(type == (TYPE_ACK | TYPE_SACK)) {
+        return "SACK";
+    } else if(type == TYPE_PRB) {
+        return "PRB";
+    } else if(type == (TYPE_ACK | TYPE_PRB)) {
+        return "PRB/ACK";
+    } else if(type == TYPE_FEC) {
+        return "FEC";
     }
     return "UNK";
 }
@@ -102,12 +306,18 @@ char *toTypeStr(uint8 type) {
 int isDat(header_t *hdr) {
     return (hdr->type & TYPE_DAT) != 0;
 }
+int isFec(header_t *hdr) {
+    return (hdr->type & TYPE_FEC) != 0;
+}
 int isSyn(header_t *hdr) {
     return (hdr->type & TYPE_SYN) != 0;
 }
 int isAck(header_t *hdr) {
     return (hdr->type & TYPE_ACK) != 0;
 }
+int isPrb(header_t *hdr) {
+    return (hdr->type & TYPE_PRB) != 0;
+}
 int isFin(header_t *hdr) {
     return (hdr->type & TYPE_FIN) != 0;
 }
@@ -115,384 +325,3478 @@ int isRst(header_t *hdr) {
     return (hdr->type & TYPE_RST) != 0;
 }
 
+// sequence numbers wrap, so they are only ordered relative to each other
+int seqBefore(uint32 a, uint32 b) {
+    return (int32)(a - b) < 0;
+}
+
+// sacked packets have left the network and lost ones aren't in it until they
+// are resent, what is left is the pipe of RFC 6675
+uint32 bytesInFlight() {
+    return next_seq - last_acked_seq - sacked_bytes - lost_bytes;
+}
+
+// nanoseconds on the monotonic clock, so wall clock steps can't fire timers
 uint64 getCurrentTime() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64)(tv.tv_sec) * 1000 + (uint64)(tv.tv_usec) / 1000;
+#ifdef SIMULATION
+    return simNow();
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)(ts.tv_sec) * 1000000000 + (uint64)(ts.tv_nsec);
 }
 
-void logPacket(header_t *hdr, int sent) {
-    char buf[150];
-    time_t curtime;
-    struct tm *loc_time;
-    curtime = time (NULL);
-    loc_time = localtime (&curtime);
-    strftime (buf, 150, "%T", loc_time);
+// HDR style histograms: a row of buckets for every power of two, each row
+// split into HISTOGRAM_SUB_BUCKETS even steps, so any value from 1 to 2^64
+// is kept to within an eighth of itself in a fixed 4KB
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
 
-    char s = sent ? 's' : 'r';
-    int32 seqno = isAck(hdr) ? hdr->ack_number : hdr->sequence_number;
-    int32 length = isDat(hdr) ? hdr->payload_size : hdr->window_size;
+typedef struct histogram {
+    uint64 buckets[HISTOGRAM_BUCKETS];
+    uint64 count;
+    uint64 sum;
+    uint64 max;
+} histogram_t;
+
+int32 histogramBucket(uint64 value) {
+    if(value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int32 exponent = 63 - __builtin_clzll(value);
+    int32 step = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + step;
+}
 
-    printf("%s %c %s:%d %s:%d %s %d %d\n", buf, s, sender_ip, sender_port, receiver_ip, receiver_port, toTypeStr(hdr->type), seqno, length);
+// the smallest value that lands in a bucket
+uint64 histogramBucketStart(int32 bucket) {
+    if(bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int32 exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64 step = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + step) << (exponent - HISTOGRAM_SUB_BITS);
 }
 
-header_t *createHeader(uint8 *buffer, int32 *buffer_index) {
-    header_t *hdr = (header_t*) buffer + *buffer_index;
-    (*buffer_index) += 10;
-    buffer[*buffer_index - 1] = '\n';
-    return hdr;
+// only ever called from one thread per histogram
+void histogramRecord(histogram_t *h, uint64 value) {
+    h->buckets[histogramBucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value > h->max) {
+        h->max = value;
+    }
 }
 
-void flushOut(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
-    int32 bytes_sent = sendto(sock, buffer, *buffer_index, 0, sa, sa_size);
-    if (bytes_sent < 0) {
-        printf("Error sending packet: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+// the largest value that could be in the bucket holding the given share of
+// samples, so percentiles are never understated
+uint64 histogramPercentile(histogram_t *h, double share) {
+    uint64 wanted = h->count * share;
+    uint64 seen = 0;
+    int32 i;
+    for(i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if(seen > wanted) {
+            uint64 end = histogramBucketStart(i + 1) - 1;
+            return end < h->max ? end : h->max;
+        }
     }
-    (*buffer_index) = 0;
+    return h->max;
 }
 
-void sendNextDatPacket(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
-    if(state != STATE_SENDING) {
-        fprintf(stderr, "Tried to send dat packet when not in sending state\n");
-        return;
+// appends "name":{...} to the JSON being built in buf
+int32 histogramJson(char *buf, int32 len, char *name, histogram_t *h) {
+    return snprintf(buf, len, ",\"%s\":{\"n\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+        name, h->count, h->count > 0 ? h->sum / h->count : 0, histogramPercentile(h, 0.5),
+        histogramPercentile(h, 0.9), histogramPercentile(h, 0.99), h->max);
+}
+
+// counters and histograms behind -j and -u
+uint64 rto_fires;
+uint64 duplicate_ack_count;
+uint64 retransmits;
+// us
+histogram_t rtt_histogram;
+// bytes, sampled as each new packet goes out
+histogram_t inflight_histogram;
+// the receive window advertised in each ack
+histogram_t window_histogram;
+// us per read of the input
+histogram_t disk_wait_histogram;
+
+// retransmission timeout, estimated from the smoothed rtt and its variance
+// (Jacobson/Karels, RFC 6298). All times are in nanoseconds. The floor is
+// well under a millisecond so loss on loopback or a LAN is recovered in
+// microseconds, queueing delay is left to the variance and the peer's ack
+// delay to cover
+#define INITIAL_RTO 100000000ULL
+#define MIN_RTO 200000ULL
+#define MAX_RTO 60000000000ULL
+// G in RFC 6298, timers only go off on a tick of the timer wheel
+#define RTO_GRANULARITY WHEEL_TICK
+
+uint64 srtt;
+// lowest rtt seen, a retransmit acked any sooner was acked for its first copy
+uint64 min_rtt;
+uint64 rttvar;
+uint64 rto;
+// the receiver may hold an ack back this long, so it is allowed for on top
+// of the rtt before a packet is called lost
+uint64 peer_ack_delay;
+
+void clampRto() {
+    if(rto < MIN_RTO) {
+        rto = MIN_RTO;
+    } else if(rto > MAX_RTO) {
+        rto = MAX_RTO;
     }
-    int32 max_size = window_size;
-    uint8 *data = (uint8*) calloc(1, max_size);
-    int32 len = fread(data, 1, max_size, sending_file);
-    if(len == 0) {
-        state = STATE_EOF;
-        fclose(sending_file);
-        printf("EOF\n");
-        return;
+}
+
+// rtt samples must never come from retransmitted packets (Karn's rule)
+void updateRtt(uint64 rtt) {
+    histogramRecord(&rtt_histogram, rtt / 1000);
+    if(min_rtt == 0 || rtt < min_rtt) {
+        min_rtt = rtt;
     }
+    if(srtt == 0) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+    } else {
+        uint64 delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+        rttvar = (3 * rttvar + delta) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+    // a fresh sample also undoes any backoff
+    rto = srtt + (4 * rttvar > RTO_GRANULARITY ? 4 * rttvar : RTO_GRANULARITY) + peer_ack_delay;
+    clampRto();
+}
 
-    sent_packet_t *sent = (sent_packet_t *) calloc(1, sizeof(sent_packet_t));
-    sent->sequence = next_seq;
-    sent->file_position = sending_position;
-    sent->size = len;
-    sent->data = data;
-    sent->next = NULL;
-    sent->sent_time = getCurrentTime();
+void backoffRto() {
+    rto *= 2;
+    clampRto();
+}
+
+// congestion control, picked with -c on the command line. Each algorithm
+// keeps cwnd up to date from the ack and loss callbacks and sendRoom()
+// never lets more than cwnd bytes be in flight
+#define TIME_PER_SECOND 1000000000ULL
+#define INITIAL_CWND (4 * segment_size)
+#define MIN_CWND (2 * segment_size)
+
+typedef struct ack_sample {
+    uint32 acked;            // bytes newly acked or sacked
+    int64 rtt;               // -1 when every newly acked packet was retransmitted
+    uint64 prior_delivered;  // delivered when the newest acked packet was sent
+    uint64 prior_time;
+    uint64 delivery_rate;    // bytes per second, 0 when unknown
+    uint64 sent_time;        // when the packet the sample is taken from was sent
+} ack_sample_t;
+
+typedef struct congestion_control {
+    char *name;
+    void (*init)();
+    void (*onAck)(ack_sample_t *sample);
+    void (*onLoss)();
+    void (*onTimeout)();
+    // bytes per second, 0 when there is nothing to go on yet
+    uint64 (*pacingRate)();
+} congestion_control_t;
+
+congestion_control_t *congestion;
+uint32 cwnd;
+uint32 ssthresh;
+// losses are only reacted to once per window, until recovery_end is acked
+int32 in_recovery;
+uint32 recovery_end;
+// bytes acked or sacked so far, and when that last changed
+uint64 delivered;
+uint64 delivered_time;
+
+uint32 lossThreshold() {
+    uint32 half = bytesInFlight() / 2;
+    return half > MIN_CWND ? half : MIN_CWND;
+}
+
+// the pacing rate over cwnd / srtt in percent, twice the window per round
+// trip while it is still growing fast, a little over it afterwards
+#define PACING_SS_RATIO 200
+#define PACING_CA_RATIO 120
+
+// -P, how packets are held back until the pacer lets them go
+#define PACING_OFF 0
+#define PACING_TIMER 1
+#define PACING_TXTIME 2
+
+int32 pacing = PACING_TIMER;
 
-    if(pending_packets != NULL) {
-        sent->next = pending_packets;
+uint64 windowPacingRate() {
+    if(srtt == 0) {
+        return 0;
     }
-    pending_packets = sent;
-    sending_position += len;
-    header_t *resp = createHeader(buffer, buffer_index);
-    resp->type = TYPE_DAT;
-    resp->sequence_number = next_seq;
-    next_seq += len;
-    resp->ack_number = 0;
-    resp->payload_size = len;
-    resp->window_size = 4096;
-    memcpy(buffer + *buffer_index, data, len);
-    (*buffer_index) += len;
-    logPacket(resp, 1);
-    flushOut(sock, buffer, buffer_index, sa, sa_size);
+    uint64 ratio = cwnd < ssthresh ? PACING_SS_RATIO : PACING_CA_RATIO;
+    return (uint64) cwnd * TIME_PER_SECOND / srtt * ratio / 100;
 }
 
-void handleTimeout(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size, int32 timeout) {
-    if(state == STATE_SENDING) {
-        sent_packet_t *oldest = NULL;
-        uint64 oldest_time;
-        sent_packet_t *sent = pending_packets;
-        uint64 curtime = getCurrentTime() - timeout;
-        while(sent != NULL) {
-            if(sent->sent_time < curtime) {
-                if(sent->sequence < oldest_time) {
-                    oldest = sent;
-                    oldest_time = sent->sequence;
-                }
-            }
-            sent = sent->next;
-        }
-        // resend lowest_packet
-        if (oldest != NULL) {
-            oldest->sent_time = getCurrentTime();
-            header_t *resp = createHeader(buffer, buffer_index);
-            resp->type = TYPE_DAT;
-            resp->sequence_number = oldest->sequence;
-            resp->ack_number = 0;
-            resp->payload_size = oldest->size;
-            resp->window_size = 4096;
-            memcpy(buffer + *buffer_index, oldest->data, oldest->size);
-            (*buffer_index) += oldest->size;
-            logPacket(resp, 1);
-            flushOut(sock, buffer, buffer_index, sa, sa_size);
-        }
+void renoInit() {
+    cwnd = INITIAL_CWND;
+    ssthresh = 0xffffffff;
+}
+
+void renoOnAck(ack_sample_t *sample) {
+    if(cwnd < ssthresh) {
+        cwnd += sample->acked;
+    } else {
+        cwnd += (uint64) segment_size * sample->acked / cwnd;
     }
 }
 
-void readPacket(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
-    //printf("Recieved packet type %s sequence %d ack %d payload %d window %d\n", toTypeStr(hdr->type), hdr->sequence_number, hdr->ack_number, hdr->payload_size, hdr->window_size);
-    logPacket(hdr, 0);
-    if(state == STATE_SYN) {
-        if(isAck(hdr)) {
-            if(hdr->ack_number != pending_syn) {
-                printf("Dropping stray ack with seq %d (expecting %d)\n", hdr->ack_number, pending_syn);
-                return;
-            }
-            window_size = hdr->window_size;
-            state = STATE_SYN_RET;
-        }
-        if(isSyn(hdr) && state == STATE_SYN_RET) {
-            header_t *resp = createHeader(buffer, buffer_index);
-            resp->type = TYPE_ACK;
-            resp->sequence_number = hdr->sequence_number;
-            resp->ack_number = hdr->sequence_number;
-            resp->payload_size = 0;
-            resp->window_size = 4096;
-            logPacket(resp, 1);
-            flushOut(sock, buffer, buffer_index, sa, sa_size);
-            state = STATE_SENDING;
-            next_seq = hdr->sequence_number + 1;
-        }
-        if(state == STATE_SENDING) {
-            sendNextDatPacket(sock, buffer, buffer_index, sa, sa_size);
-        }
-    } else if(state == STATE_SYN_RET) {
-        if(isSyn(hdr)) {
-            header_t *resp = createHeader(buffer, buffer_index);
-            resp->type = TYPE_ACK;
-            resp->sequence_number = hdr->sequence_number;
-            resp->ack_number = hdr->sequence_number;
-            resp->payload_size = 0;
-            resp->window_size = 4096;
-            logPacket(resp, 1);
-            flushOut(sock, buffer, buffer_index, sa, sa_size);
-            state = STATE_SENDING;
-            next_seq = hdr->sequence_number + 1;
-            sendNextDatPacket(sock, buffer, buffer_index, sa, sa_size);
-        }
-    } else if(state == STATE_SENDING) {
-        if(isAck(hdr)) {
-            sent_packet_t *last = NULL;
-            sent_packet_t *sent = pending_packets;
-            if(hdr->ack_number == last_acked_seq) {
-                // packet lost
-                handleTimeout(sock, buffer, buffer_index, sa, sa_size, 0);
-                return;
-            }
-            while(sent != NULL) {
-                if(sent->sequence == hdr->ack_number) {
-                    last_acked_seq = hdr->ack_number;
-                    free(sent->data);
-                    if(last == NULL) {
-                        pending_packets = sent->next;
-                    } else {
-                        last->next = sent->next;
-                    }
-                    free(sent);
-                    printf("Packet %d acknowledged\n", hdr->ack_number);
-                    window_size = hdr->window_size;
-                    if(pending_packets == NULL) {
-                        sendNextDatPacket(sock, buffer, buffer_index, sa, sa_size);
-                        if(state == STATE_EOF) {
-                            printf("All packets ack'ed\n");
-                            state = STATE_FIN;
-                            header_t *resp = createHeader(buffer, buffer_index);
-                            resp->type = TYPE_FIN;
-                            resp->sequence_number = next_seq;
-                            pending_syn = next_seq;
-                            resp->ack_number = 0;
-                            resp->payload_size = 0;
-                            resp->window_size = 4096;
-                            logPacket(resp, 1);
-                            flushOut(sock, buffer, buffer_index, sa, sa_size);
-                        }
-                    }
-                    break;
-                }
-                last = sent;
-                sent = sent->next;
-            }
-        }
-    } else if(state == STATE_EOF) {
-        if(isAck(hdr)) {
-            sent_packet_t *last = NULL;
-            sent_packet_t *sent = pending_packets;
-            while(sent != NULL) {
-                if(sent->sequence == hdr->ack_number) {
-                    free(sent->data);
-                    if(last == NULL) {
-                        pending_packets = sent->next;
-                    } else {
-                        last->next = sent->next;
-                    }
-                    free(sent);
-                    printf("Packet %d acknowledged\n", hdr->ack_number);
-                    window_size = hdr->window_size;
-                    if(pending_packets == NULL) {
-                        printf("All packets ack'ed\n");
-                        state = STATE_FIN;
-                        header_t *resp = createHeader(buffer, buffer_index);
-                        resp->type = TYPE_FIN;
-                        resp->sequence_number = next_seq;
-                        pending_syn = next_seq;
-                        resp->ack_number = 0;
-                        resp->payload_size = 0;
-                        resp->window_size = 4096;
-                        logPacket(resp, 1);
-                        flushOut(sock, buffer, buffer_index, sa, sa_size);
-                    }
-                    break;
-                }
-                last = sent;
-                sent = sent->next;
-            }
-        }
-    } else if(state == STATE_FIN) {
-        if(isAck(hdr)) {
-            if(pending_syn != hdr->ack_number) {
-                return;
-            }
-            state = STATE_FIN_ACK;
+void renoOnLoss() {
+    ssthresh = lossThreshold();
+    cwnd = ssthresh;
+}
+
+void renoOnTimeout() {
+    ssthresh = lossThreshold();
+    cwnd = segment_size;
+}
+
+// CUBIC (RFC 8312), window sizes are in bytes
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+double cubic_w_max;
+double cubic_w_est;
+double cubic_k;
+uint64 cubic_epoch_start;
+
+void cubicInit() {
+    renoInit();
+    cubic_w_max = 0;
+    cubic_epoch_start = 0;
+}
+
+void cubicOnAck(ack_sample_t *sample) {
+    if(cwnd < ssthresh) {
+        cwnd += sample->acked;
+        return;
+    }
+    uint64 now = getCurrentTime();
+    if(cubic_epoch_start == 0) {
+        cubic_epoch_start = now;
+        if(cwnd < cubic_w_max) {
+            cubic_k = cbrt((cubic_w_max - cwnd) / segment_size / CUBIC_C);
+        } else {
+            cubic_k = 0;
+            cubic_w_max = cwnd;
         }
-        if(isFin(hdr)) {
-            state = STATE_FIN_ACK;
-            header_t *resp = createHeader(buffer, buffer_index);
-            resp->type = TYPE_ACK;
-            resp->sequence_number = 0;
-            resp->ack_number = hdr->sequence_number;
-            resp->payload_size = 0;
-            resp->window_size = 4096;
-            logPacket(resp, 1);
-            flushOut(sock, buffer, buffer_index, sa, sa_size);
+        cubic_w_est = cwnd;
+    }
+    double t = (double)(now - cubic_epoch_start) / TIME_PER_SECOND - cubic_k;
+    double target = cubic_w_max + CUBIC_C * t * t * t * segment_size;
+    // never grow slower than reno would in the same situation
+    cubic_w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * segment_size * sample->acked / cwnd;
+    if(target < cubic_w_est) {
+        target = cubic_w_est;
+    }
+    if(target > 1.5 * cwnd) {
+        target = 1.5 * cwnd;
+    }
+    if(target > cwnd) {
+        cwnd += (target - cwnd) * sample->acked / cwnd;
+    }
+}
+
+void cubicOnLoss() {
+    cubic_epoch_start = 0;
+    if(cwnd < cubic_w_max) {
+        // fast convergence, give up bandwidth to newer flows
+        cubic_w_max = cwnd * (1 + CUBIC_BETA) / 2;
+    } else {
+        cubic_w_max = cwnd;
+    }
+    ssthresh = cwnd * CUBIC_BETA;
+    if(ssthresh < MIN_CWND) {
+        ssthresh = MIN_CWND;
+    }
+    cwnd = ssthresh;
+}
+
+void cubicOnTimeout() {
+    cubicOnLoss();
+    cwnd = segment_size;
+}
+
+// BBR-style model based control: cwnd follows the measured bandwidth delay
+// product instead of reacting to loss
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+#define BBR_PROBE_RTT 3
+#define BBR_HIGH_GAIN 2.885
+#define BBR_CWND_GAIN 2.0
+#define BBR_BW_WINDOW_ROUNDS 10
+#define BBR_MIN_RTT_WINDOW (10 * TIME_PER_SECOND)
+#define BBR_PROBE_RTT_TIME (TIME_PER_SECOND / 5)
+#define BBR_MIN_CWND (4 * segment_size)
+
+double bbr_gain_cycle[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+int32 bbr_mode;
+double bbr_pacing_gain;
+double bbr_cwnd_gain;
+// largest delivery rate seen in each of the last few rounds
+uint64 bbr_bw_samples[BBR_BW_WINDOW_ROUNDS];
+uint64 bbr_round;
+uint64 bbr_next_round_delivered;
+uint64 bbr_full_bw;
+int32 bbr_full_bw_rounds;
+int32 bbr_filled_pipe;
+int64 bbr_min_rtt;
+uint64 bbr_min_rtt_stamp;
+uint64 bbr_probe_rtt_done;
+int32 bbr_cycle_index;
+uint64 bbr_cycle_stamp;
+
+uint64 bbrMaxBw() {
+    uint64 bw = 0;
+    int32 i;
+    for(i = 0; i < BBR_BW_WINDOW_ROUNDS; i++) {
+        if(bbr_bw_samples[i] > bw) {
+            bw = bbr_bw_samples[i];
         }
-    } else if(state == STATE_FIN_ACK) {
-        if(isAck(hdr)) {
-            if(pending_syn != hdr->ack_number) {
-                return;
-            }
-            close(sock);
-            exit(0);
+    }
+    return bw;
+}
+
+void bbrInit() {
+    cwnd = INITIAL_CWND;
+    ssthresh = 0xffffffff;
+    bbr_mode = BBR_STARTUP;
+    bbr_pacing_gain = BBR_HIGH_GAIN;
+    bbr_cwnd_gain = BBR_HIGH_GAIN;
+    memset(bbr_bw_samples, 0, sizeof bbr_bw_samples);
+    bbr_round = 0;
+    bbr_next_round_delivered = 0;
+    bbr_full_bw = 0;
+    bbr_full_bw_rounds = 0;
+    bbr_filled_pipe = 0;
+    bbr_min_rtt = -1;
+    bbr_min_rtt_stamp = getCurrentTime();
+    bbr_cycle_index = 0;
+}
+
+void bbrEnterProbeBw(uint64 now) {
+    bbr_mode = BBR_PROBE_BW;
+    bbr_cwnd_gain = BBR_CWND_GAIN;
+    bbr_cycle_index = 2;
+    bbr_cycle_stamp = now;
+    bbr_pacing_gain = bbr_gain_cycle[bbr_cycle_index];
+}
+
+void bbrOnAck(ack_sample_t *sample) {
+    uint64 now = getCurrentTime();
+    int32 round_start = 0;
+    if(sample->prior_delivered >= bbr_next_round_delivered) {
+        bbr_next_round_delivered = delivered;
+        bbr_round++;
+        bbr_bw_samples[bbr_round % BBR_BW_WINDOW_ROUNDS] = 0;
+        round_start = 1;
+    }
+    if(sample->delivery_rate > bbr_bw_samples[bbr_round % BBR_BW_WINDOW_ROUNDS]) {
+        bbr_bw_samples[bbr_round % BBR_BW_WINDOW_ROUNDS] = sample->delivery_rate;
+    }
+    int32 min_rtt_expired = now - bbr_min_rtt_stamp > BBR_MIN_RTT_WINDOW;
+    if(sample->rtt >= 0 && (bbr_min_rtt < 0 || sample->rtt <= bbr_min_rtt || min_rtt_expired)) {
+        bbr_min_rtt = sample->rtt;
+        bbr_min_rtt_stamp = now;
+    }
+    uint64 bw = bbrMaxBw();
+    if(round_start && !bbr_filled_pipe) {
+        // the pipe is full once three rounds in a row fail to raise bw by a quarter
+        if(bw >= bbr_full_bw * 5 / 4) {
+            bbr_full_bw = bw;
+            bbr_full_bw_rounds = 0;
+        } else if(++bbr_full_bw_rounds >= 3) {
+            bbr_filled_pipe = 1;
         }
-        if(isFin(hdr)) {
-            state = STATE_FIN_ACK;
-            header_t *resp = createHeader(buffer, buffer_index);
-            resp->type = TYPE_ACK;
-            resp->sequence_number = 0;
-            resp->ack_number = hdr->sequence_number;
-            resp->payload_size = 0;
-            resp->window_size = 4096;
-            logPacket(resp, 1);
-            flushOut(sock, buffer, buffer_index, sa, sa_size);
-            close(sock);
-            exit(0);
+    }
+    uint64 bdp = bbr_min_rtt > 0 ? bw * bbr_min_rtt / TIME_PER_SECOND : 0;
+
+    if(bbr_mode == BBR_STARTUP && bbr_filled_pipe) {
+        bbr_mode = BBR_DRAIN;
+        bbr_pacing_gain = 1 / BBR_HIGH_GAIN;
+        bbr_cwnd_gain = BBR_HIGH_GAIN;
+    }
+    if(bbr_mode == BBR_DRAIN && bytesInFlight() <= bdp) {
+        bbrEnterProbeBw(now);
+    }
+    if(bbr_mode == BBR_PROBE_BW && bbr_min_rtt >= 0 && now - bbr_cycle_stamp > bbr_min_rtt) {
+        bbr_cycle_index = (bbr_cycle_index + 1) % (sizeof bbr_gain_cycle / sizeof bbr_gain_cycle[0]);
+        bbr_cycle_stamp = now;
+        bbr_pacing_gain = bbr_gain_cycle[bbr_cycle_index];
+    }
+    if(bbr_mode != BBR_PROBE_RTT && min_rtt_expired) {
+        bbr_mode = BBR_PROBE_RTT;
+        bbr_pacing_gain = 1;
+        bbr_probe_rtt_done = now + BBR_PROBE_RTT_TIME;
+    }
+    if(bbr_mode == BBR_PROBE_RTT && now > bbr_probe_rtt_done) {
+        bbr_min_rtt_stamp = now;
+        if(bbr_filled_pipe) {
+            bbrEnterProbeBw(now);
+        } else {
+            bbr_mode = BBR_STARTUP;
+            bbr_pacing_gain = BBR_HIGH_GAIN;
+            bbr_cwnd_gain = BBR_HIGH_GAIN;
         }
     }
-}
 
-int32 getRandomSequence() {
-    return 100; // Chosen by fair dice roll
+    // without a pacer the pacing gain is applied to the window instead
+    uint64 target = bdp * bbr_cwnd_gain * (pacing == PACING_OFF ? bbr_pacing_gain : 1);
+    if(target < BBR_MIN_CWND) {
+        target = BBR_MIN_CWND;
+    }
+    if(bbr_filled_pipe) {
+        cwnd = cwnd + sample->acked < target ? cwnd + sample->acked : target;
+    } else if(cwnd < target || delivered < INITIAL_CWND) {
+        cwnd += sample->acked;
+    }
+    if(bbr_mode == BBR_PROBE_RTT && cwnd > BBR_MIN_CWND) {
+        cwnd = BBR_MIN_CWND;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    if(argc != 6) {
-        printf("Usage: ./rdps <sender_ip> <sender_port> <reciever_ip> <reciever_port> <sent_file>\n");
-        return 0;
+uint64 bbrPacingRate() {
+    uint64 bw = bbrMaxBw();
+    if(bw == 0) {
+        return windowPacingRate();
     }
-    sender_ip = argv[1];
-    sender_port = atoi(argv[2]);
-    receiver_ip = argv[3];
-    receiver_port = atoi(argv[4]);
-    char *output = argv[5];
+    return bw * bbr_pacing_gain;
+}
 
-    printf("Starting RDP sender targetting %s:%d and receiving on %s:%d. Sendering file %s\n", receiver_ip, receiver_port, sender_ip, sender_port, output);
+void bbrOnLoss() {
+}
 
-    sending_file = fopen(output, "rb");
-    if(!sending_file) {
-        fprintf(stderr, "Output file %s not found.\n", output);
-        return 0;
+void bbrOnTimeout() {
+    cwnd = BBR_MIN_CWND;
+}
+
+congestion_control_t congestion_controls[] = {
+    {"reno", renoInit, renoOnAck, renoOnLoss, renoOnTimeout, windowPacingRate},
+    {"cubic", cubicInit, cubicOnAck, cubicOnLoss, cubicOnTimeout, windowPacingRate},
+    {"bbr", bbrInit, bbrOnAck, bbrOnLoss, bbrOnTimeout, bbrPacingRate},
+};
+
+congestion_control_t *findCongestionControl(char *name) {
+    int32 i;
+    for(i = 0; i < sizeof congestion_controls / sizeof congestion_controls[0]; i++) {
+        if(strcmp(congestion_controls[i].name, name) == 0) {
+            return &congestion_controls[i];
+        }
     }
-    last_acked_seq = 0;
-    sending_position = 0;
-    pending_packets = NULL;
+    return NULL;
+}
 
-    state = STATE_WAITING;
+void congestionLoss() {
+    if(in_recovery) {
+        return;
+    }
+    in_recovery = 1;
+    recovery_end = next_seq;
+    congestion->onLoss();
+}
 
-    int32 s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (s == -1) {
-        fprintf(stderr, "Failed to create socket\n");
-        fprintf(stderr, "%s\n", strerror(errno));
-        return 1;
+void congestionTimeout() {
+    in_recovery = 1;
+    recovery_end = next_seq;
+    congestion->onTimeout();
+}
+
+// how much new data may go out. cwnd bounds the pipe, but the receiver only
+// has room for window_size bytes past the cumulative ack, sacked or not, so
+// its window bounds everything sent since then
+int32 sendRoom() {
+    uint32 window = window_size < MAX_SEQUENCE_WINDOW ? window_size : MAX_SEQUENCE_WINDOW;
+    int64 network = (int64) cwnd - bytesInFlight();
+    int64 receiver = (int64) window - (uint32) (next_seq - last_acked_seq);
+    return network < receiver ? network : receiver;
+}
+
+// the pacer spreads a window over the round trip instead of letting it out
+// in one burst that a shallow queue on the path would drop. Packets leave at
+// pacingRate() and -R caps that outright, even with -P off. -P timer holds
+// packets back until their turn and wakes the main loop for them, -P txtime
+// hands them over a little early stamped with a departure time (SO_TXTIME)
+// and lets the kernel hold them, which takes the fq qdisc on the interface
+// packets may run this far ahead of the schedule, so at high rates the loop
+// isn't woken for every one of them
+#define PACING_SLACK 500000ULL
+// and this far ahead with txtime
+#define TXTIME_HORIZON 2000000ULL
+
+// bytes per second, 0 for no cap
+uint64 rate_cap;
+// when the next packet is due to leave, 0 if it may go at once
+uint64 pacing_next;
+// set while fillWindow waits for the pacer
+int32 pacing_held;
+// the departure time queuePacket stamps the next packet with, 0 for none
+uint64 packet_txtime;
+uint64 pacing_waits;
+
+// bytes per second, 0 for as fast as the window allows
+uint64 pacingRate() {
+    uint64 rate = pacing == PACING_OFF ? 0 : congestion->pacingRate();
+    if(rate_cap != 0 && (rate == 0 || rate > rate_cap)) {
+        rate = rate_cap;
     }
+    return rate;
+}
 
-    struct sockaddr_in sa;
-    struct sockaddr_in sout;
-    ssize_t recsize;
-    socklen_t fromlen;
+uint64 pacingAhead() {
+    return pacing == PACING_TXTIME ? TXTIME_HORIZON : PACING_SLACK;
+}
 
-    memset(&sa, 0, sizeof sa);
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = inet_addr(sender_ip);
-    sa.sin_port = htons(sender_port);
-    fromlen = sizeof(sa);
+int32 pacingAllows(uint64 now) {
+    return pacing_next <= now + pacingAhead();
+}
 
-    memset(&sout, 0, sizeof sout);
-    sout.sin_family = AF_INET;
-    sout.sin_addr.s_addr = inet_addr(receiver_ip);
-    sout.sin_port = htons(receiver_port);
+// when fillWindow may go on, 0 if it isn't waiting for the pacer
+uint64 pacingDeadline() {
+    return pacing_held ? pacing_next - pacingAhead() : 0;
+}
 
-    if (bind(s, (struct sockaddr *)&sa, sizeof sa) == -1) {
-        fprintf(stderr, "Failed to bind port\n");
-        fprintf(stderr, "%s\n", strerror(errno));
-        close(s);
-        return 1;
+// books a packet of len bytes on the schedule, returns when it leaves
+uint64 pacePacket(int32 len) {
+    uint64 now = getCurrentTime();
+    uint64 rate = pacingRate();
+    if(rate == 0) {
+        pacing_next = 0;
+        return now;
+    }
+    // time spent idle isn't saved up for a burst later
+    uint64 departure = pacing_next > now ? pacing_next : now;
+    pacing_next = departure + (uint64) len * TIME_PER_SECOND / rate;
+    if(pacing == PACING_TXTIME && departure > now) {
+        packet_txtime = departure;
+        return departure;
     }
+    return now;
+}
 
-    int32 opt = 1;
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+// with -t every packet is traced as a fixed size binary record. The main
+// thread puts records in a ring and a thread of its own writes them out, so
+// a packet costs a few stores rather than a printf. A full ring drops records
+// instead of holding up the sender. rdpt decodes a trace back into the text
+// that -v 3 prints
+#define TRACE_MAGIC 0x54504452
+#define TRACE_VERSION 2
+// records, a power of two
+#define TRACE_RING_LENGTH 65536
+#define TRACE_DRAIN_INTERVAL 10000000
 
-    uint8 output_buffer[PACKET_BUFFER_LENGTH];
-    int32 output_index = 0;
-    uint8 packet_buffer[PACKET_BUFFER_LENGTH];
-    int32 buffer_index = 0;
+typedef struct trace_file_header {
+    uint32 magic;
+    uint32 version;
+    // the two clocks read together, so record times map to the wall clock
+    uint64 realtime_base;
+    uint64 monotonic_base;
+} trace_file_header_t;
 
-    int32 initial_seq = getRandomSequence();
-    pending_syn = initial_seq;
-    header_t *hdr = createHeader(output_buffer, &output_index);
-    hdr->type = TYPE_SYN;
-    hdr->sequence_number = initial_seq;
-    hdr->ack_number = 0;
-    hdr->payload_size = 0;
-    hdr->window_size = 0;
-    logPacket(hdr, 1);
-    flushOut(s, output_buffer, &output_index, (struct sockaddr*)&sout, sizeof sout);
-    state = STATE_SYN;
-    fd_set fdset;
-    while (1) {
+typedef struct trace_record {
+    // CLOCK_MONOTONIC ns
+    uint64 time;
+    // addresses in network order, ports in host order
+    uint32 local_addr;
+    uint32 remote_addr;
+    uint32 sequence_number;
+    uint32 ack_number;
+    uint32 window_size;
+    uint16 local_port;
+    uint16 remote_port;
+    uint16 payload_size;
+    uint8 sent;
+    uint8 type;
+    uint32 reserved;
+} trace_record_t;
 
-        FD_ZERO(&fdset);
-        FD_SET(s, &fdset);
-        struct timeval timeout = {0, TIMEOUT_USEC};
-        select(s + 1, &fdset, NULL, NULL, &timeout);
+int32 tracing;
+int trace_fd;
+trace_record_t *trace_ring;
+// only the main thread moves trace_head and only the drain thread trace_tail
+uint64 trace_head;
+uint64 trace_tail;
+int32 trace_stop;
+uint64 trace_dropped;
+uint32 trace_local_addr;
+uint16 trace_local_port;
+// rdps only ever talks to the one receiver
+uint32 trace_remote_addr;
+pthread_t trace_thread;
 
-        if(FD_ISSET(s, &fdset)) {
-            recsize = recvfrom(s, (void*) packet_buffer + buffer_index, sizeof packet_buffer - buffer_index, 0, (struct sockaddr*)&sa, &fromlen);
-            printf("Received %lld\n", recsize);
-            if (recsize < 0) {
-                fprintf(stderr, "%s\n", strerror(errno));
-                return 1;
-            }
-            buffer_index += recsize;
-            if(buffer_index >= HEADER_LENGTH) {
-                header_t *hdr = (header_t*) packet_buffer;
-                int32 full_packet_size =  hdr->payload_size + HEADER_LENGTH;
-                if(buffer_index >= full_packet_size) {
-                    readPacket(hdr, packet_buffer + HEADER_LENGTH, s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen);
-                    int32 nbuffer_index = buffer_index - full_packet_size;
-                    if(nbuffer_index > 0) {
-                        memcpy(packet_buffer, packet_buffer + full_packet_size, nbuffer_index);
+void traceRecord(header_t *hdr, int sent, uint32 remote_addr, uint16 remote_port) {
+    uint64 head = trace_head;
+    if(head - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) == TRACE_RING_LENGTH) {
+        trace_dropped++;
+        return;
+    }
+    trace_record_t *r = &trace_ring[head & (TRACE_RING_LENGTH - 1)];
+    r->time = getCurrentTime();
+    r->local_addr = trace_local_addr;
+    r->remote_addr = remote_addr;
+    r->local_port = trace_local_port;
+    r->remote_port = remote_port;
+    r->sequence_number = hdr->sequence_number;
+    r->ack_number = hdr->ack_number;
+    r->payload_size = hdr->payload_size;
+    r->window_size = hdr->window_size;
+    r->sent = sent;
+    r->type = hdr->type;
+    r->reserved = 0;
+    __atomic_store_n(&trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void *traceMain(void *arg) {
+    struct timespec interval = {0, TRACE_DRAIN_INTERVAL};
+    while(1) {
+        // anything traced before the stop is seen is still written out
+        int32 stop = __atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE);
+        uint64 head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+        uint64 tail = trace_tail;
+        while(tail != head) {
+            uint64 pos = tail & (TRACE_RING_LENGTH - 1);
+            uint64 count = head - tail < TRACE_RING_LENGTH - pos ? head - tail : TRACE_RING_LENGTH - pos;
+            uint8 *data = (uint8*) &trace_ring[pos];
+            uint64 len = count * sizeof(trace_record_t);
+            while(len > 0) {
+                ssize_t n = write(trace_fd, data, len);
+                if(n < 0) {
+                    if(errno == EINTR) {
+                        continue;
                     }
-                    buffer_index = nbuffer_index;
+                    fprintf(stderr, "Error writing the trace, no longer tracing: %s\n", strerror(errno));
+                    return NULL;
                 }
+                data += n;
+                len -= n;
             }
-        } else {
-            handleTimeout(s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen, TIMEOUT_USEC);
+            tail += count;
+            __atomic_store_n(&trace_tail, tail, __ATOMIC_RELEASE);
+        }
+        if(stop) {
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// writes out what is left in the ring, runs at exit
+void stopTrace() {
+    if(!tracing) {
+        return;
+    }
+    tracing = 0;
+    __atomic_store_n(&trace_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_thread, NULL);
+    close(trace_fd);
+    if(trace_dropped > 0) {
+        fprintf(stderr, "Trace ring overflowed, %llu records dropped\n", trace_dropped);
+    }
+}
+
+void startTrace(char *path, char *local_ip, int32 local_port) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(trace_fd < 0) {
+        fprintf(stderr, "Error opening %s for the trace: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    trace_ring = (trace_record_t*) malloc(TRACE_RING_LENGTH * sizeof(trace_record_t));
+    if(trace_ring == NULL) {
+        fprintf(stderr, "Failed to allocate the trace ring\n");
+        exit(EXIT_FAILURE);
+    }
+    trace_file_header_t header;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.realtime_base = (uint64)(ts.tv_sec) * 1000000000 + (uint64)(ts.tv_nsec);
+    header.monotonic_base = getCurrentTime();
+    if(write(trace_fd, &header, sizeof header) != sizeof header) {
+        fprintf(stderr, "Error writing the trace: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    trace_local_addr = inet_addr(local_ip);
+    trace_local_port = local_port;
+    if(pthread_create(&trace_thread, NULL, traceMain, NULL) != 0) {
+        fprintf(stderr, "Failed to start the trace thread\n");
+        exit(EXIT_FAILURE);
+    }
+    tracing = 1;
+    atexit(stopTrace);
+}
+
+void logPacket(header_t *hdr, int sent) {
+    if(tracing) {
+        traceRecord(hdr, sent, trace_remote_addr, receiver_port);
+    }
+    if(log_level < LOG_PACKET) {
+        return;
+    }
+    char buf[150];
+    time_t curtime;
+    struct tm *loc_time;
+#ifdef SIMULATION
+    // simulated time, so the same run always logs the same lines
+    curtime = getCurrentTime() / 1000000000;
+    loc_time = gmtime (&curtime);
+#else
+    curtime = time (NULL);
+    loc_time = localtime (&curtime);
+#endif
+    strftime (buf, 150, "%T", loc_time);
+
+    char s = sent ? 's' : 'r';
+    uint32 seqno = isAck(hdr) ? hdr->ack_number : hdr->sequence_number;
+    uint32 length = isDat(hdr) || isFec(hdr) ? hdr->payload_size : hdr->window_size;
+
+    printf("%s %c %s:%d %s:%d %s %u %u\n", buf, s, sender_ip, sender_port, receiver_ip, receiver_port, toTypeStr(hdr->type), seqno, length);
+}
+
+void putUint16(uint8 *p, uint16 value) {
+    value = htons(value);
+    memcpy(p, &value, sizeof value);
+}
+
+void putUint32(uint8 *p, uint32 value) {
+    value = htonl(value);
+    memcpy(p, &value, sizeof value);
+}
+
+uint16 getUint16(uint8 *p) {
+    uint16 value;
+    memcpy(&value, p, sizeof value);
+    return ntohs(value);
+}
+
+uint32 getUint32(uint8 *p) {
+    uint32 value;
+    memcpy(&value, p, sizeof value);
+    return ntohl(value);
+}
+
+// encodes hdr and its options at the end of buffer
+void writeHeader(header_t *hdr, uint8 *buffer, int32 *buffer_index) {
+    uint8 *p = buffer + *buffer_index;
+    int32 padded = (hdr->options_length + 3) & ~3;
+    p[0] = HEADER_VERSION;
+    p[1] = hdr->type;
+    p[2] = padded / 4;
+    p[3] = 0;
+    putUint32(p + 4, hdr->sequence_number);
+    putUint32(p + 8, hdr->ack_number);
+    putUint32(p + 12, hdr->window_size);
+    putUint16(p + 16, hdr->payload_size);
+    putUint16(p + 18, 0);
+    if(hdr->options_length > 0) {
+        memcpy(p + HEADER_LENGTH, hdr->options, hdr->options_length);
+    }
+    memset(p + HEADER_LENGTH + hdr->options_length, OPTION_END, padded - hdr->options_length);
+    (*buffer_index) += HEADER_LENGTH + padded;
+}
+
+// decodes the header at the start of a packet. Returns where the payload
+// starts, or 0 for a packet of another version or one cut short
+int32 readHeader(uint8 *packet, int32 len, header_t *hdr) {
+    if(len < HEADER_LENGTH) {
+        return 0;
+    }
+    hdr->type = packet[1];
+    hdr->options_length = packet[2] * 4;
+    hdr->sequence_number = getUint32(packet + 4);
+    hdr->ack_number = getUint32(packet + 8);
+    hdr->window_size = getUint32(packet + 12);
+    hdr->payload_size = getUint16(packet + 16);
+    hdr->options = packet + HEADER_LENGTH;
+    int32 payload = HEADER_LENGTH + hdr->options_length;
+    if(packet[0] != HEADER_VERSION || len < payload + hdr->payload_size) {
+        return 0;
+    }
+    return payload;
+}
+
+// the data of the first option of a kind, NULL if there is none. len is set
+// to the length of the data
+uint8 *findOption(header_t *hdr, uint8 kind, int32 *len) {
+    int32 i = 0;
+    while(i + 2 <= hdr->options_length && hdr->options[i] != OPTION_END) {
+        int32 option_length = hdr->options[i + 1];
+        if(option_length < 2 || i + option_length > hdr->options_length) {
+            break;
+        }
+        if(hdr->options[i] == kind) {
+            *len = option_length - 2;
+            return hdr->options + i + 2;
+        }
+        i += option_length;
+    }
+    return NULL;
+}
+
+// copies out the blocks of an ack's OPTION_SACK, returns how many
+int32 readSackBlocks(header_t *hdr, sack_block_t *blocks) {
+    int32 len;
+    uint8 *data = findOption(hdr, OPTION_SACK, &len);
+    if(data == NULL) {
+        return 0;
+    }
+    int32 count = len / 8 < MAX_SACK_BLOCKS ? len / 8 : MAX_SACK_BLOCKS;
+    int32 i;
+    for(i = 0; i < count; i++) {
+        blocks[i].start = getUint32(data + i * 8);
+        blocks[i].end = getUint32(data + i * 8 + 4);
+    }
+    return count;
+}
+
+// outgoing packets are queued and handed to the kernel with one sendmmsg per
+// batch, and incoming ones are drained with recvmmsg. -b sets the batch size
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 1024
+// room for a header and any SACK blocks, payloads are sent from where they are
+#define QUEUED_HEADER_LENGTH 64
+
+typedef union txtime_control {
+    char buf[CMSG_SPACE(sizeof(uint64))];
+    struct cmsghdr align;
+} txtime_control_t;
+
+typedef struct queued_packet {
+    uint8 header[QUEUED_HEADER_LENGTH];
+    struct sockaddr_storage addr;
+    txtime_control_t control;
+} queued_packet_t;
+
+int32 batch_size;
+queued_packet_t *send_queue;
+struct mmsghdr *send_msgs;
+struct iovec *send_iovs;
+int32 send_queue_length;
+uint8 *recv_buffers;
+struct mmsghdr *recv_msgs;
+struct iovec *recv_iovs;
+struct sockaddr_in *recv_addrs;
+// syscall accounting, printed when the transfer finishes
+uint64 send_calls;
+uint64 sent_datagrams;
+uint64 recv_calls;
+uint64 received_datagrams;
+
+void initBatches(int32 size) {
+    batch_size = size;
+    send_queue = (queued_packet_t*) calloc(size, sizeof(queued_packet_t));
+    send_msgs = (struct mmsghdr*) calloc(size, sizeof(struct mmsghdr));
+    send_iovs = (struct iovec*) calloc(size * 2, sizeof(struct iovec));
+    recv_buffers = (uint8*) malloc((size_t) size * PACKET_BUFFER_LENGTH);
+    recv_msgs = (struct mmsghdr*) calloc(size, sizeof(struct mmsghdr));
+    recv_iovs = (struct iovec*) calloc(size, sizeof(struct iovec));
+    recv_addrs = (struct sockaddr_in*) calloc(size, sizeof(struct sockaddr_in));
+    if(!send_queue || !send_msgs || !send_iovs || !recv_buffers || !recv_msgs || !recv_iovs || !recv_addrs) {
+        fprintf(stderr, "Failed to allocate batches of %d packets\n", size);
+        exit(EXIT_FAILURE);
+    }
+    int32 i;
+    for(i = 0; i < size; i++) {
+        recv_iovs[i].iov_base = recv_buffers + (size_t) i * PACKET_BUFFER_LENGTH;
+        recv_iovs[i].iov_len = PACKET_BUFFER_LENGTH;
+        recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+        recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        recv_msgs[i].msg_hdr.msg_name = &recv_addrs[i];
+    }
+}
+
+// set when the main loop runs on io_uring rather than select
+int32 use_uring;
+
+#ifdef USE_IO_URING
+// built with make URING=1 the main loop runs on io_uring. A multishot recvmsg
+// stays armed on a ring of provided buffers, queued packets go in as one
+// batch of sendmsg SQEs, the reader's eventfd is read through the ring and
+// deadlines are the timeout of io_uring_enter. If the kernel won't set up a
+// ring select is used as before
+#define URING_ENTRIES (2 * MAX_BATCH_SIZE)
+// must be a power of two
+#define URING_BUFFERS 256
+// room for the recvmsg_out header and the source address in front of a packet
+#define URING_BUFFER_LENGTH (PACKET_BUFFER_LENGTH + 256)
+#define URING_BUFFER_GROUP 0
+// user_data of the SQEs, sends add the index of the packet in the batch
+#define URING_RECV 1
+#define URING_WAKE 2
+#define URING_SEND 0x10000
+
+typedef struct uring_completion {
+    int32 res;
+    uint32 flags;
+} uring_completion_t;
+
+int uring_fd;
+unsigned *sq_head;
+unsigned *sq_tail;
+unsigned *sq_mask;
+unsigned *sq_array;
+unsigned sq_entries;
+unsigned sq_local_tail;
+unsigned sq_unsubmitted;
+struct io_uring_sqe *sqes;
+unsigned *cq_head;
+unsigned *cq_tail;
+unsigned *cq_mask;
+struct io_uring_cqe *cqes;
+struct io_uring_buf_ring *buf_ring;
+uint16 buf_ring_tail;
+uint8 *uring_buffers;
+struct msghdr uring_recv_msg;
+int32 uring_recv_armed;
+int32 uring_wake_armed;
+int32 uring_woken;
+uint64 uring_wake_count;
+int32 *uring_send_results;
+int32 uring_sends_outstanding;
+// receive completions reaped while waiting on sends, handled by the main loop
+#define PENDING_RECV_LENGTH (2 * URING_BUFFERS)
+uring_completion_t pending_recv[PENDING_RECV_LENGTH];
+uint32 pending_head;
+uint32 pending_tail;
+
+struct io_uring_sqe *uringSqe() {
+    if(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        fprintf(stderr, "io_uring submission queue overflow\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned index = sq_local_tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sq_array[index] = index;
+    sq_local_tail++;
+    sq_unsubmitted++;
+    return sqe;
+}
+
+// submits whatever SQEs are queued and waits for min_complete completions,
+// giving up after timeout nanoseconds unless it is zero
+void uringEnter(unsigned min_complete, uint64 timeout) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    if(timeout != 0) {
+        ts.tv_sec = timeout / TIME_PER_SECOND;
+        ts.tv_nsec = timeout % TIME_PER_SECOND;
+        arg.ts = (uint64) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int32 ret = syscall(__NR_io_uring_enter, uring_fd, sq_unsubmitted, min_complete, flags, timeout != 0 ? &arg : NULL, timeout != 0 ? sizeof arg : 0);
+    if(ret < 0) {
+        if(errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return;
+        }
+        fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    sq_unsubmitted -= ret;
+}
+
+// hands a receive buffer back to the kernel
+void uringRecycle(uint16 bid) {
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_ring_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64) (uring_buffers + (size_t) bid * URING_BUFFER_LENGTH);
+    buf->len = URING_BUFFER_LENGTH;
+    buf->bid = bid;
+    buf_ring_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+void uringArmRecv(int32 sock) {
+    struct io_uring_sqe *sqe = uringSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64) &uring_recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECV;
+    uring_recv_armed = 1;
+}
+
+void uringArmWake(int32 fd) {
+    struct io_uring_sqe *sqe = uringSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64) &uring_wake_count;
+    sqe->len = sizeof uring_wake_count;
+    sqe->user_data = URING_WAKE;
+    uring_wake_armed = 1;
+}
+
+// sorts out every completion waiting in the CQ ring
+void uringReap() {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        if(cqe->user_data >= URING_SEND) {
+            uring_send_results[cqe->user_data - URING_SEND] = cqe->res;
+            uring_sends_outstanding--;
+        } else if(cqe->user_data == URING_RECV) {
+            if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                uring_recv_armed = 0;
+            }
+            // every entry holds a buffer or ends the multishot, so this can't fill
+            uring_completion_t *c = &pending_recv[pending_tail++ % PENDING_RECV_LENGTH];
+            c->res = cqe->res;
+            c->flags = cqe->flags;
+        } else if(cqe->user_data == URING_WAKE) {
+            uring_wake_armed = 0;
+            if(cqe->res > 0) {
+                uring_woken = 1;
+            }
+        }
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// sends a batch through the ring, same contract as sendmmsg. The sends are
+// linked so a failure cancels the rest, nothing after the first failed
+// message has gone out and the caller can resend from there
+int32 uringSendBatch(int32 sock, struct mmsghdr *msgs, int32 count) {
+    int32 i;
+    for(i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = uringSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sock;
+        sqe->addr = (uint64) &msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+        sqe->user_data = URING_SEND + i;
+    }
+    uring_sends_outstanding = count;
+    while(uring_sends_outstanding > 0) {
+        uringEnter(1, 0);
+        send_calls++;
+        uringReap();
+    }
+    for(i = 0; i < count; i++) {
+        if(uring_send_results[i] < 0) {
+            errno = -uring_send_results[i];
+            return i > 0 ? i : -1;
+        }
+    }
+    return count;
+}
+
+int32 uringInit(int32 sock) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(uring_fd < 0) {
+        fprintf(stderr, "io_uring not available (%s), using select\n", strerror(errno));
+        return 0;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring too old, using select\n");
+        close(uring_fd);
+        return 0;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uint8 *rings = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring_buffers = (uint8*) malloc((size_t) URING_BUFFERS * URING_BUFFER_LENGTH);
+    uring_send_results = (int32*) calloc(batch_size, sizeof(int32));
+    if(rings == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED || !uring_buffers || !uring_send_results) {
+        fprintf(stderr, "Failed to set up io_uring, using select\n");
+        close(uring_fd);
+        return 0;
+    }
+    sq_head = (unsigned*) (rings + params.sq_off.head);
+    sq_tail = (unsigned*) (rings + params.sq_off.tail);
+    sq_mask = (unsigned*) (rings + params.sq_off.ring_mask);
+    sq_array = (unsigned*) (rings + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    cq_head = (unsigned*) (rings + params.cq_off.head);
+    cq_tail = (unsigned*) (rings + params.cq_off.tail);
+    cq_mask = (unsigned*) (rings + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64) buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        fprintf(stderr, "Can't register io_uring buffers (%s), using select\n", strerror(errno));
+        close(uring_fd);
+        return 0;
+    }
+    int32 i;
+    for(i = 0; i < URING_BUFFERS; i++) {
+        uringRecycle(i);
+    }
+    memset(&uring_recv_msg, 0, sizeof uring_recv_msg);
+    uring_recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    uringArmRecv(sock);
+    return 1;
+}
+#endif
+
+// sendmmsg, or the same through io_uring
+int32 sendBatch(int32 sock, struct mmsghdr *msgs, int32 count) {
+#ifdef SIMULATION
+    return simSendBatch(SIM_SENDER, msgs, count);
+#endif
+#ifdef USE_IO_URING
+    if(use_uring) {
+        return uringSendBatch(sock, msgs, count);
+    }
+#endif
+    return sendmmsg(sock, msgs, count, 0);
+}
+
+// with -g runs of queued packets to the same peer that share a size go out as
+// one UDP_SEGMENT send and the kernel cuts them back into datagrams. Every
+// packet of a run but the last must be exactly the segment size
+#define MAX_GSO_SEGMENTS 64
+#define MAX_GSO_BYTES 65000
+
+typedef union gso_control {
+    char buf[CMSG_SPACE(sizeof(uint16))];
+    struct cmsghdr align;
+} gso_control_t;
+
+int32 use_gso;
+struct mmsghdr *gso_msgs;
+gso_control_t *gso_controls;
+int32 *gso_first;
+uint64 gso_sends;
+uint64 gso_packets;
+
+int32 queuedLength(int32 i) {
+    return send_iovs[2 * i].iov_len + send_iovs[2 * i + 1].iov_len;
+}
+
+int32 sameDestination(int32 a, int32 b) {
+    return send_msgs[a].msg_hdr.msg_namelen == send_msgs[b].msg_hdr.msg_namelen
+        && memcmp(send_msgs[a].msg_hdr.msg_name, send_msgs[b].msg_hdr.msg_name, send_msgs[a].msg_hdr.msg_namelen) == 0;
+}
+
+void initGso(int32 sock) {
+    // a zero segment size is harmless and only tells us the kernel knows the option
+    int32 size = 0;
+    if(setsockopt(sock, SOL_UDP, UDP_SEGMENT, &size, sizeof size) != 0) {
+        fprintf(stderr, "UDP GSO not supported (%s), sending one datagram per packet\n", strerror(errno));
+        use_gso = 0;
+        return;
+    }
+    gso_msgs = (struct mmsghdr*) calloc(batch_size, sizeof(struct mmsghdr));
+    gso_controls = (gso_control_t*) calloc(batch_size, sizeof(gso_control_t));
+    gso_first = (int32*) calloc(batch_size, sizeof(int32));
+    if(!gso_msgs || !gso_controls || !gso_first) {
+        fprintf(stderr, "Failed to allocate GSO batches of %d packets\n", batch_size);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// sends the queue coalesced into segmented sends. Returns 0 if the kernel
+// refused a segmented send, with first_unsent set to the first packet not sent
+int32 flushGso(int32 sock, int32 *first_unsent) {
+    int32 count = 0;
+    int32 i = 0;
+    while(i < send_queue_length) {
+        int32 size = queuedLength(i);
+        int32 total = size;
+        int32 j = i + 1;
+        while(j < send_queue_length && j - i < MAX_GSO_SEGMENTS && sameDestination(i, j)) {
+            int32 len = queuedLength(j);
+            if(len > size || total + len > MAX_GSO_BYTES) {
+                break;
+            }
+            total += len;
+            j++;
+            if(len < size) {
+                // a short packet can only end a run
+                break;
+            }
+        }
+        struct msghdr *msg = &gso_msgs[count].msg_hdr;
+        memcpy(msg, &send_msgs[i].msg_hdr, sizeof(struct msghdr));
+        // queued packets keep two iovecs each, the unused payload one is empty
+        msg->msg_iovlen = 2 * (j - i);
+        if(j - i > 1) {
+            msg->msg_control = gso_controls[count].buf;
+            msg->msg_controllen = sizeof(gso_controls[count].buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16));
+            *(uint16*) CMSG_DATA(cmsg) = size;
+            gso_sends++;
+            gso_packets += j - i;
+        }
+        gso_first[count++] = i;
+        i = j;
+    }
+    int32 done = 0;
+    while(done < count) {
+        int32 sent = sendBatch(sock, gso_msgs + done, count - done);
+        send_calls++;
+        if (sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EIO || errno == EINVAL || errno == EMSGSIZE || errno == EOPNOTSUPP) {
+                *first_unsent = gso_first[done];
+                return 0;
+            }
+            printf("Error sending packet: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        done += sent;
+    }
+    return 1;
+}
+
+void flushQueue(int32 sock) {
+    int32 done = 0;
+    if(use_gso && send_queue_length > 1) {
+        if(flushGso(sock, &done)) {
+            sent_datagrams += send_queue_length;
+            send_queue_length = 0;
+            return;
+        }
+        // usually the device can't checksum segmented sends or the segments
+        // don't fit the path MTU, either way it won't get better
+        fprintf(stderr, "UDP GSO send failed (%s), sending one datagram per packet\n", strerror(errno));
+        use_gso = 0;
+    }
+    while(done < send_queue_length) {
+        int32 sent = sendBatch(sock, send_msgs + done, send_queue_length - done);
+        send_calls++;
+        if (sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            printf("Error sending packet: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        done += sent;
+    }
+    sent_datagrams += send_queue_length;
+    send_queue_length = 0;
+}
+
+// queues the header sitting in buffer, followed by a payload that is sent
+// from where it lives. The payload must stay put until the queue is flushed
+void queuePacket(int32 sock, uint8 *buffer, int32 *buffer_index, uint8 *payload, int32 len, struct sockaddr*sa, int32 sa_size) {
+    if(*buffer_index > QUEUED_HEADER_LENGTH) {
+        fprintf(stderr, "Packet header of %d bytes is too long to queue\n", *buffer_index);
+        exit(EXIT_FAILURE);
+    }
+    if(send_queue_length == batch_size) {
+        flushQueue(sock);
+    }
+    int32 i = send_queue_length++;
+    queued_packet_t *queued = &send_queue[i];
+    memcpy(queued->header, buffer, *buffer_index);
+    memcpy(&queued->addr, sa, sa_size);
+    send_iovs[2 * i].iov_base = queued->header;
+    send_iovs[2 * i].iov_len = *buffer_index;
+    send_iovs[2 * i + 1].iov_base = payload;
+    send_iovs[2 * i + 1].iov_len = len;
+    memset(&send_msgs[i], 0, sizeof(struct mmsghdr));
+    send_msgs[i].msg_hdr.msg_name = &queued->addr;
+    send_msgs[i].msg_hdr.msg_namelen = sa_size;
+    send_msgs[i].msg_hdr.msg_iov = &send_iovs[2 * i];
+    send_msgs[i].msg_hdr.msg_iovlen = len > 0 ? 2 : 1;
+    if(packet_txtime != 0) {
+        struct msghdr *msg = &send_msgs[i].msg_hdr;
+        msg->msg_control = queued->control.buf;
+        msg->msg_controllen = sizeof(queued->control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64));
+        memcpy(CMSG_DATA(cmsg), &packet_txtime, sizeof(uint64));
+        packet_txtime = 0;
+    }
+    (*buffer_index) = 0;
+}
+
+// receives up to a batch of datagrams, returns how many or -1 with errno set
+int32 receiveBatch(int32 sock, int32 flags) {
+    int32 i;
+    for(i = 0; i < batch_size; i++) {
+        recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int32 received = recvmmsg(sock, recv_msgs, batch_size, flags, NULL);
+    recv_calls++;
+    if(received > 0) {
+        received_datagrams += received;
+    }
+    return received;
+}
+
+void printBatchStats(uint64 data_bytes) {
+    LOG(LOG_INFO, "Batched I/O: %llu datagrams sent in %llu calls, %llu received in %llu calls", sent_datagrams, send_calls, received_datagrams, recv_calls);
+    if(data_bytes > 0) {
+        double mb = data_bytes / 1000000.0;
+        LOG(LOG_INFO, ", %.1f syscalls per MB instead of %.1f", (send_calls + recv_calls) / mb, (sent_datagrams + received_datagrams) / mb);
+    }
+    LOG(LOG_INFO, "\n");
+}
+
+// queues the packet in buffer, it goes out with the next flushQueue
+void flushOut(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    queuePacket(sock, buffer, buffer_index, NULL, 0, sa, sa_size);
+}
+
+// payload buffers come from a fixed pool carved out of one arena, sized from
+// the window negotiated in the handshake and recycled as packets are acked,
+// so steady state sending never touches the heap
+#define POOL_SPARE_BUFFERS 2
+
+uint8 *pool_arena;
+uint8 **pool_free;
+int32 pool_free_count;
+int32 pool_capacity;
+int32 pool_buffer_size;
+// allocator statistics, printed when the transfer finishes
+uint64 pool_heap_allocations;
+uint64 pool_acquired;
+uint64 pool_released;
+int32 pool_peak_in_use;
+uint64 pool_exhausted;
+
+void poolInit(int32 capacity, int32 buffer_size) {
+    free(pool_arena);
+    free(pool_free);
+    pool_arena = (uint8*) malloc((size_t) capacity * buffer_size);
+    pool_free = (uint8**) malloc(capacity * sizeof(uint8*));
+    if(pool_arena == NULL || pool_free == NULL) {
+        fprintf(stderr, "Failed to allocate %d packet buffers\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    pool_heap_allocations += 2;
+    pool_capacity = capacity;
+    pool_buffer_size = buffer_size;
+    for(pool_free_count = 0; pool_free_count < capacity; pool_free_count++) {
+        pool_free[pool_free_count] = pool_arena + (size_t) pool_free_count * buffer_size;
+    }
+}
+
+uint8 *poolAcquire() {
+    if(pool_free_count == 0) {
+        return NULL;
+    }
+    pool_acquired++;
+    if(pool_capacity - pool_free_count + 1 > pool_peak_in_use) {
+        pool_peak_in_use = pool_capacity - pool_free_count + 1;
+    }
+    return pool_free[--pool_free_count];
+}
+
+void poolRelease(uint8 *data) {
+    pool_released++;
+    pool_free[pool_free_count++] = data;
+}
+
+void printPoolStats() {
+    LOG(LOG_INFO, "Buffer pool: %d buffers of %d bytes, peak %d in use, %llu acquired, %llu released, %llu times exhausted, %llu heap allocations\n",
+        pool_capacity, pool_buffer_size, pool_peak_in_use, pool_acquired, pool_released, pool_exhausted, pool_heap_allocations);
+}
+
+sent_packet_t *segmentAt(uint32 segment) {
+    return &sent_ring[segment % MAX_SEGMENTS_IN_FLIGHT];
+}
+
+uint32 segmentsInFlight() {
+    return next_segment - first_segment;
+}
+
+// first segment in flight that starts at or after seq
+uint32 findSegment(uint32 seq) {
+    uint32 target = seq - last_acked_seq;
+    uint32 low = 0;
+    uint32 high = segmentsInFlight();
+    while(low < high) {
+        uint32 mid = low + (high - low) / 2;
+        if(segmentAt(first_segment + mid)->sequence - last_acked_seq < target) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return first_segment + low;
+}
+
+// first segment at or after this one that hasn't been sacked. The sacked_until
+// links are shortened on the way so a run of sacked packets is crossed once
+uint32 nextUnsacked(uint32 segment) {
+    uint32 end = segment;
+    while(end != next_segment && segmentAt(end)->sacked) {
+        end = segmentAt(end)->sacked_until;
+    }
+    while(segment != end) {
+        sent_packet_t *sent = segmentAt(segment);
+        segment = sent->sacked_until;
+        sent->sacked_until = end;
+    }
+    return end;
+}
+
+void cancelTimer(sent_packet_t *sent) {
+    if(sent->deadline == 0) {
+        return;
+    }
+    uint32 slot = (sent->deadline / WHEEL_TICK) % WHEEL_SLOTS;
+    if(sent->timer_prev != NULL) {
+        sent->timer_prev->timer_next = sent->timer_next;
+    } else {
+        timer_wheel[slot] = sent->timer_next;
+    }
+    if(sent->timer_next != NULL) {
+        sent->timer_next->timer_prev = sent->timer_prev;
+    }
+    if(timer_wheel[slot] == NULL) {
+        wheel_occupied[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    sent->deadline = 0;
+}
+
+void armTimer(sent_packet_t *sent, uint64 deadline) {
+    cancelTimer(sent);
+    // anything already overdue goes in the next slot to be expired
+    if(deadline < wheel_tick * WHEEL_TICK) {
+        deadline = wheel_tick * WHEEL_TICK;
+    }
+    uint32 slot = (deadline / WHEEL_TICK) % WHEEL_SLOTS;
+    sent->deadline = deadline;
+    sent->timer_prev = NULL;
+    sent->timer_next = timer_wheel[slot];
+    if(sent->timer_next != NULL) {
+        sent->timer_next->timer_prev = sent;
+    }
+    timer_wheel[slot] = sent;
+    wheel_occupied[slot / 64] |= 1ULL << (slot % 64);
+}
+
+// unlinks every timer due by now and returns them chained through timer_next
+sent_packet_t *expireTimers(uint64 now) {
+    sent_packet_t *expired = NULL;
+    uint64 now_tick = now / WHEEL_TICK;
+    uint64 tick;
+    for(tick = wheel_tick; tick <= now_tick && tick - wheel_tick < WHEEL_SLOTS; tick++) {
+        sent_packet_t *sent = timer_wheel[tick % WHEEL_SLOTS];
+        while(sent != NULL) {
+            sent_packet_t *next = sent->timer_next;
+            if(sent->deadline <= now) {
+                cancelTimer(sent);
+                sent->timer_next = expired;
+                expired = sent;
+            }
+            sent = next;
+        }
+    }
+    // the current slot may still hold timers due later in this tick
+    wheel_tick = now_tick;
+    return expired;
+}
+
+// earliest armed deadline, 0 if none. Slots are visited in time order using
+// the occupancy bitmap, and the search stops at the first slot holding a
+// timer due in this turn of the wheel
+uint64 nextRetransmitTime() {
+    uint64 earliest = 0;
+    uint32 i = 0;
+    while(i < WHEEL_SLOTS) {
+        uint32 slot = (wheel_tick + i) % WHEEL_SLOTS;
+        uint64 bits = wheel_occupied[slot / 64] >> (slot % 64);
+        if(bits == 0) {
+            i += 64 - slot % 64;
+            continue;
+        }
+        i += __builtin_ctzll(bits);
+        if(i >= WHEEL_SLOTS) {
+            break;
+        }
+        sent_packet_t *sent;
+        for(sent = timer_wheel[(wheel_tick + i) % WHEEL_SLOTS]; sent != NULL; sent = sent->timer_next) {
+            if(earliest == 0 || sent->deadline < earliest) {
+                earliest = sent->deadline;
+            }
+        }
+        if(earliest != 0 && earliest < (wheel_tick + i + 1) * WHEEL_TICK) {
+            break;
+        }
+        i++;
+    }
+    return earliest;
+}
+
+// the input is read ahead of the sender so the protocol loop rarely waits on
+// the disk. The kernel is asked to keep READ_AHEAD_LENGTH ahead in the page
+// cache, and with -r a reader thread fills a ring of file data that segments
+// are copied out of, waking the main loop through an eventfd
+#define READ_AHEAD_LENGTH (4 * 1024 * 1024)
+#define READ_CHUNK (256 * 1024)
+// a read taking longer than this went to the disk rather than the page cache
+#define READ_WAIT_THRESHOLD 100000
+
+int32 use_reader;
+int64 readahead_position;
+uint8 *read_ring;
+// bytes of the file put in the ring and bytes taken out, both only ever grow
+uint64 read_filled;
+uint64 read_taken;
+int32 read_eof;
+int32 reader_stop;
+int reader_wake_fd;
+pthread_t reader_thread;
+pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t read_space = PTHREAD_COND_INITIALIZER;
+// how often sending stopped for want of data versus want of window
+uint64 disk_waits;
+uint64 network_waits;
+uint64 disk_wait_time;
+
+// cuts a read of len bytes at position short at the end of the flow's range
+int64 clampToRange(int64 position, int64 len) {
+    if(range_length >= 0 && range_length - position < len) {
+        return range_length - position;
+    }
+    return len;
+}
+
+// asks the kernel to bring the next stretch of the file into memory
+void adviseReadAhead() {
+#ifdef SIMULATION
+    return;
+#endif
+    while(readahead_position < sending_position + READ_AHEAD_LENGTH) {
+        int64 len = clampToRange(readahead_position, READ_CHUNK);
+        if(use_mmap) {
+            if(readahead_position + range_start + len > file_size) {
+                len = file_size - range_start - readahead_position;
+            }
+            if(len <= 0) {
+                return;
+            }
+            madvise(file_map + range_start + readahead_position, len, MADV_WILLNEED);
+        } else {
+            if(len <= 0) {
+                return;
+            }
+            readahead(fileno(sending_file), range_start + readahead_position, len);
+        }
+        readahead_position += READ_CHUNK;
+    }
+}
+
+void *readerMain(void *arg) {
+    int fd = fileno(sending_file);
+    pthread_mutex_lock(&read_lock);
+    while(1) {
+        while(read_filled - read_taken + READ_CHUNK > READ_AHEAD_LENGTH && !reader_stop) {
+            pthread_cond_wait(&read_space, &read_lock);
+        }
+        if(reader_stop) {
+            break;
+        }
+        uint64 pos = read_filled % READ_AHEAD_LENGTH;
+        uint64 len = READ_AHEAD_LENGTH - pos < READ_CHUNK ? READ_AHEAD_LENGTH - pos : READ_CHUNK;
+        len = clampToRange(read_filled, len);
+        pthread_mutex_unlock(&read_lock);
+
+        // plain reads, so pipes work too
+        uint64 start = getCurrentTime();
+        ssize_t n = len > 0 ? read(fd, read_ring + pos, len) : 0;
+        histogramRecord(&disk_wait_histogram, (getCurrentTime() - start) / 1000);
+        if(n < 0 && errno != EINTR) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&read_lock);
+        if(n == 0) {
+            read_eof = 1;
+        } else if(n > 0) {
+            read_filled += n;
+        }
+        uint64 one = 1;
+        if(write(reader_wake_fd, &one, sizeof one) < 0) {
+            fprintf(stderr, "Error waking the sender: %s\n", strerror(errno));
+        }
+        if(read_eof) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&read_lock);
+    return NULL;
+}
+
+void startReader() {
+    read_ring = (uint8*) malloc(READ_AHEAD_LENGTH);
+    reader_wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(read_ring == NULL || reader_wake_fd < 0) {
+        fprintf(stderr, "Failed to set up the reader thread\n");
+        exit(EXIT_FAILURE);
+    }
+    if(pthread_create(&reader_thread, NULL, readerMain, NULL) != 0) {
+        fprintf(stderr, "Failed to start the reader thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void stopReader() {
+    pthread_mutex_lock(&read_lock);
+    reader_stop = 1;
+    pthread_cond_signal(&read_space);
+    pthread_mutex_unlock(&read_lock);
+    pthread_join(reader_thread, NULL);
+}
+
+// copies up to len bytes of read ahead data, returns how many, 0 at the end
+// of the file or -1 if the reader hasn't got that far yet
+int32 takeReadAhead(uint8 *data, int32 len) {
+    pthread_mutex_lock(&read_lock);
+    uint64 available = read_filled - read_taken;
+    int32 eof = read_eof;
+    pthread_mutex_unlock(&read_lock);
+    if(available == 0) {
+        return eof ? 0 : -1;
+    }
+    if(len > available) {
+        len = available;
+    }
+    // only this thread touches the filled part of the ring
+    uint64 pos = read_taken % READ_AHEAD_LENGTH;
+    int32 first = len < READ_AHEAD_LENGTH - pos ? len : READ_AHEAD_LENGTH - pos;
+    memcpy(data, read_ring + pos, first);
+    memcpy(data + first, read_ring, len - first);
+
+    pthread_mutex_lock(&read_lock);
+    read_taken += len;
+    pthread_cond_signal(&read_space);
+    pthread_mutex_unlock(&read_lock);
+    return len;
+}
+
+void printReadStats() {
+    LOG(LOG_INFO, "Sender waited on the disk %llu times (%.1f ms in reads) and on the network %llu times\n",
+        disk_waits, disk_wait_time / 1000000.0, network_waits);
+}
+
+// DPLPMTUD (RFC 8899). With -p segments start out sized for BASE_PLPMTU and
+// the sender searches up to path_mtu with padded PRB packets that carry no
+// data, so a lost probe costs nothing. The receiver echoes each one as PRB/ACK
+#define BASE_PLPMTU 1200
+#define MAX_PROBES 3
+// the search stops once the bounds are this close
+#define PROBE_GRANULARITY 16
+
+int32 probing;
+int32 plpmtu;
+int32 probe_ceiling;
+int32 probe_size;
+int32 probe_count;
+uint32 probe_id;
+uint64 probe_deadline;
+uint64 probes_sent;
+
+int32 segmentSizeFor(int32 mtu) {
+    return mtu - PACKET_OVERHEAD;
+}
+
+void nextProbe(int32 sock, struct sockaddr*sa, int32 sa_size);
+
+void probeFailed(int32 sock, struct sockaddr*sa, int32 sa_size) {
+    probe_ceiling = probe_size - 1;
+    nextProbe(sock, sa, sa_size);
+}
+
+void sendProbe(int32 sock, struct sockaddr*sa, int32 sa_size) {
+    uint8 probe[MAX_PATH_MTU];
+    int32 index = 0;
+    header_t hdr = {0};
+    hdr.type = TYPE_PRB;
+    hdr.sequence_number = ++probe_id;
+    hdr.ack_number = 0;
+    hdr.payload_size = 0;
+    hdr.window_size = 0;
+    writeHeader(&hdr, probe, &index);
+    logPacket(&hdr, 1);
+    // padding up to the size being probed, the receiver ignores it
+    int32 len = probe_size - (PACKET_OVERHEAD - HEADER_LENGTH);
+    memset(probe + index, 0, len - index);
+    probes_sent++;
+    probe_count++;
+    probe_deadline = getCurrentTime() + rto;
+    // probes skip the send queue so they are never coalesced with data
+    if(sendto(sock, probe, len, 0, sa, sa_size) < 0) {
+        if(errno == EMSGSIZE) {
+            // bigger than the local interface, no need to wait for it
+            probeFailed(sock, sa, sa_size);
+            return;
+        }
+        printf("Error sending probe: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void nextProbe(int32 sock, struct sockaddr*sa, int32 sa_size) {
+    if(probe_ceiling - plpmtu < PROBE_GRANULARITY) {
+        probing = 0;
+        probe_deadline = 0;
+        LOG(LOG_INFO, "Path MTU is %d, sending segments of %d bytes after %llu probes\n", plpmtu, segment_size, probes_sent);
+        return;
+    }
+    probe_size = (plpmtu + probe_ceiling + 1) / 2;
+    probe_count = 0;
+    sendProbe(sock, sa, sa_size);
+}
+
+void startProbing(int32 sock, struct sockaddr*sa, int32 sa_size) {
+    plpmtu = path_mtu < BASE_PLPMTU ? path_mtu : BASE_PLPMTU;
+    segment_size = segmentSizeFor(plpmtu);
+    probe_ceiling = path_mtu;
+    probe_id = 0;
+    // the largest size is tried first, it is often right
+    probe_size = probe_ceiling;
+    probe_count = 0;
+    if(probe_ceiling - plpmtu < PROBE_GRANULARITY) {
+        nextProbe(sock, sa, sa_size);
+        return;
+    }
+    sendProbe(sock, sa, sa_size);
+}
+
+void probeAcked(header_t *hdr, int32 sock, struct sockaddr*sa, int32 sa_size) {
+    if(!probing || hdr->ack_number != probe_id) {
+        // an echo of an earlier, already given up on, probe
+        return;
+    }
+    plpmtu = probe_size;
+    segment_size = segmentSizeFor(plpmtu);
+    nextProbe(sock, sa, sa_size);
+}
+
+void handleProbeTimeout(int32 sock, struct sockaddr*sa, int32 sa_size) {
+    if(probe_count < MAX_PROBES) {
+        sendProbe(sock, sa, sa_size);
+    } else {
+        probeFailed(sock, sa, sa_size);
+    }
+}
+
+// GF(256) arithmetic for FEC parity, modulo the polynomial 0x11d. Adding is
+// XOR and multiplying goes through log and exp tables. The bulk of the work is
+// dst ^= c * src over a whole segment, which the AVX2 and SSSE3 kernels do 32
+// or 16 bytes at a time by looking up c times each nibble with a shuffle
+#define GF_POLYNOMIAL 0x11d
+
+uint8 gf_exp[512];
+uint8 gf_log[256];
+uint8 gf_mul_table[256][256];
+// c times every low nibble and every high nibble, for the shuffles
+uint8 gf_mul_low[256][16];
+uint8 gf_mul_high[256][16];
+
+uint8 gfMul(uint8 a, uint8 b) {
+    if(a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8 gfInv(uint8 a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+void gfMulAddScalar(uint8 *dst, uint8 *src, uint8 c, int32 len) {
+    int32 i;
+    if(c == 0) {
+        return;
+    }
+    if(c == 1) {
+        for(i = 0; i < len; i++) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    uint8 *row = gf_mul_table[c];
+    for(i = 0; i < len; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+void gfMulAddSsse3(uint8 *dst, uint8 *src, uint8 c, int32 len) {
+    if(c == 0) {
+        return;
+    }
+    __m128i low = _mm_loadu_si128((__m128i *) gf_mul_low[c]);
+    __m128i high = _mm_loadu_si128((__m128i *) gf_mul_high[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int32 i;
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((__m128i *) (src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(s, mask)),
+            _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void gfMulAddAvx2(uint8 *dst, uint8 *src, uint8 c, int32 len) {
+    if(c == 0) {
+        return;
+    }
+    // the shuffle looks up within each 128 bit lane, so both lanes get the table
+    __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) gf_mul_low[c]));
+    __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) gf_mul_high[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int32 i;
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i *) (src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(s, mask)),
+            _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        __m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+void (*gfMulAdd)(uint8 *dst, uint8 *src, uint8 c, int32 len) = gfMulAddScalar;
+
+void gfInit() {
+    int32 x = 1;
+    int32 i;
+    for(i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if(x & 0x100) {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+    for(i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    int32 c;
+    for(c = 0; c < 256; c++) {
+        for(i = 0; i < 256; i++) {
+            gf_mul_table[c][i] = gfMul(c, i);
+        }
+        for(i = 0; i < 16; i++) {
+            gf_mul_low[c][i] = gf_mul_table[c][i];
+            gf_mul_high[c][i] = gf_mul_table[c][i << 4];
+        }
+    }
+    char *kernel = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        gfMulAdd = gfMulAddAvx2;
+        kernel = "AVX2";
+    } else if(__builtin_cpu_supports("ssse3")) {
+        gfMulAdd = gfMulAddSsse3;
+        kernel = "SSSE3";
+    }
+#endif
+    LOG(LOG_INFO, "FEC arithmetic uses %s kernels\n", kernel);
+}
+
+// a block of up to FEC_MAX_DATA DAT packets gets up to FEC_MAX_PARITY FEC
+// packets, and the receiver rebuilds as many lost DAT packets as FEC packets
+// arrived. One FEC packet is the XOR of the block. More are Reed-Solomon rows
+// of a Cauchy matrix, 1 / (j ^ (FEC_MAX_PARITY + i)) for FEC packet j and DAT
+// packet i, any square part of which can be inverted
+#define FEC_MAX_DATA 32
+#define FEC_MAX_PARITY 4
+#define FEC_MAX_SEGMENT 9000
+
+uint8 fecCoefficient(int32 parity, int32 j, int32 i) {
+    return parity == 1 ? 1 : gfInv(j ^ (FEC_MAX_PARITY + i));
+}
+
+// with -F each block of fec_block_size new DAT packets is followed by its
+// parity. The parity is added up as each DAT packet goes out, since an early
+// one may be acked and its buffer reused before the block is done. Unless -F
+// fixes it, the number of FEC packets follows the loss seen, FEC_LOSS_MARGIN
+// times the packets a block is expected to lose, and none below FEC_MIN_LOSS
+#define FEC_MIN_LOSS 0.002
+#define FEC_LOSS_MARGIN 2
+// blocks remembered for markHoles, one per packet in flight at most
+#define FEC_SENT_BLOCKS MAX_SEGMENTS_IN_FLIGHT
+
+typedef struct fec_sent_block {
+    uint32 serial;
+    uint32 first_segment;
+    int32 count;
+    int32 parity;
+    // when its parity was sent, 0 while the block is still being filled
+    uint64 closed_time;
+} fec_sent_block_t;
+
+int32 fec_block_size;
+// -1 to follow the loss
+int32 fec_fixed_parity = -1;
+fec_sent_block_t fec_sent_blocks[FEC_SENT_BLOCKS];
+// the block being filled
+uint32 fec_serial;
+uint32 fec_start;
+int32 fec_count;
+int32 fec_parity;
+int32 fec_segment_size;
+int32 fec_last_size;
+uint8 *fec_parity_data;
+// packets found lost, each counted once whether it was retransmitted or left
+// for the parity. Parity packets aren't counted, nor are packets sent again
+uint64 lost_segments;
+double fec_loss_rate;
+uint64 fec_lost_at_open;
+uint32 fec_segment_at_open;
+uint64 parity_packets;
+uint64 fec_waits;
+
+void fecInit() {
+    gfInit();
+    fec_parity_data = malloc(FEC_MAX_PARITY * FEC_MAX_SEGMENT);
+    if(fec_parity_data == NULL) {
+        fprintf(stderr, "Failed to allocate FEC parity buffers\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// the loss over the packets sent since the last block opened, with -F fixing
+// the parity it is still kept up to date for the metrics
+void fecUpdateLossRate() {
+    if(next_segment != fec_segment_at_open) {
+        double sample = (double) (lost_segments - fec_lost_at_open) / (uint32) (next_segment - fec_segment_at_open);
+        fec_loss_rate += (sample - fec_loss_rate) / 8;
+    }
+    fec_lost_at_open = lost_segments;
+    fec_segment_at_open = next_segment;
+}
+
+int32 fecParityFor() {
+    if(fec_fixed_parity >= 0) {
+        return fec_fixed_parity;
+    }
+    if(fec_loss_rate < FEC_MIN_LOSS) {
+        return 0;
+    }
+    int32 parity = (int32) ceil(FEC_LOSS_MARGIN * fec_loss_rate * fec_block_size);
+    return parity < FEC_MAX_PARITY ? parity : FEC_MAX_PARITY;
+}
+
+void fecOpen(uint32 sequence, int32 len) {
+    fecUpdateLossRate();
+    fec_parity = fecParityFor();
+    fec_start = sequence;
+    fec_segment_size = len;
+    fec_count = 0;
+    if(fec_parity == 0) {
+        return;
+    }
+    fec_serial++;
+    if(fec_serial == 0) {
+        fec_serial = 1;
+    }
+    fec_sent_block_t *block = &fec_sent_blocks[fec_serial % FEC_SENT_BLOCKS];
+    block->serial = fec_serial;
+    block->first_segment = next_segment;
+    block->count = 0;
+    block->parity = fec_parity;
+    block->closed_time = 0;
+    memset(fec_parity_data, 0, fec_parity * FEC_MAX_SEGMENT);
+}
+
+// sends the parity of the block being filled
+void fecClose(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(fec_count == 0) {
+        return;
+    }
+    if(fec_parity > 0) {
+        fec_sent_block_t *block = &fec_sent_blocks[fec_serial % FEC_SENT_BLOCKS];
+        block->count = fec_count;
+        block->closed_time = getCurrentTime();
+        uint8 option[FEC_OPTION_LENGTH] = {OPTION_FEC, FEC_OPTION_LENGTH, fec_count, fec_parity, 0, 0};
+        putUint16(option + 6, fec_last_size);
+        int32 j;
+        for(j = 0; j < fec_parity; j++) {
+            option[4] = j;
+            header_t resp = {0};
+            resp.type = TYPE_FEC;
+            resp.sequence_number = fec_start;
+            resp.ack_number = 0;
+            resp.payload_size = fec_segment_size;
+            resp.window_size = 4096;
+            resp.options = option;
+            resp.options_length = FEC_OPTION_LENGTH;
+            pacePacket(HEADER_LENGTH + FEC_OPTION_LENGTH + fec_segment_size);
+            writeHeader(&resp, buffer, buffer_index);
+            logPacket(&resp, 1);
+            queuePacket(sock, buffer, buffer_index, fec_parity_data + j * FEC_MAX_SEGMENT, fec_segment_size, sa, sa_size);
+            parity_packets++;
+        }
+        // the next block adds up its parity in the same buffers
+        flushQueue(sock);
+    }
+    fec_count = 0;
+}
+
+// adds a new DAT packet to the block being filled, closing the block once it
+// is full or the packet is short. Only the last packet of a block may be
+// shorter than the first, so a longer one starts a block of its own
+void fecAdd(sent_packet_t *sent, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(fec_count > 0 && sent->size > fec_segment_size) {
+        fecClose(sock, buffer, buffer_index, sa, sa_size);
+    }
+    if(fec_count == 0) {
+        fecOpen(sent->sequence, sent->size);
+    }
+    sent->fec_block = fec_parity > 0 ? fec_serial : 0;
+    int32 j;
+    for(j = 0; j < fec_parity; j++) {
+        gfMulAdd(fec_parity_data + j * FEC_MAX_SEGMENT, sent->data, fecCoefficient(fec_parity, j, fec_count), sent->size);
+    }
+    fec_count++;
+    fec_last_size = sent->size;
+    if(fec_parity > 0) {
+        fec_sent_blocks[fec_serial % FEC_SENT_BLOCKS].count = fec_count;
+    }
+    if(fec_count == fec_block_size || sent->size < fec_segment_size) {
+        fecClose(sock, buffer, buffer_index, sa, sa_size);
+    }
+}
+
+// whether a hole should wait for its block's parity rather than be resent.
+// It waits while no more of the block is missing than there is parity for,
+// until the parity has had a round trip to get there and be acked. A block
+// still being filled is closed, so its parity goes out now
+int32 fecMayRebuild(sent_packet_t *sent, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(sent->fec_block == 0 || sent->retransmitted) {
+        return 0;
+    }
+    fec_sent_block_t *block = &fec_sent_blocks[sent->fec_block % FEC_SENT_BLOCKS];
+    if(block->serial != sent->fec_block) {
+        return 0;
+    }
+    if(block->closed_time == 0) {
+        fecClose(sock, buffer, buffer_index, sa, sa_size);
+    }
+    if(getCurrentTime() - block->closed_time > srtt + srtt / 4) {
+        return 0;
+    }
+    // packets after the last sacked one may just not have got there yet
+    int32 missing = 0;
+    int32 unsacked = 0;
+    int32 i;
+    for(i = 0; i < block->count; i++) {
+        uint32 segment = block->first_segment + i;
+        if((int32)(segment - first_segment) < 0) {
+            continue;
+        }
+        if(segmentAt(segment)->sacked) {
+            missing = unsacked;
+        } else {
+            unsacked++;
+        }
+    }
+    if(missing > block->parity) {
+        return 0;
+    }
+    // the parity is as good as a retransmit, so the timer runs from when it went
+    if(sent->deadline != 0 && sent->deadline < block->closed_time + rto) {
+        armTimer(sent, block->closed_time + rto);
+    }
+    if(!sent->fec_waited) {
+        sent->fec_waited = 1;
+        lost_segments++;
+        fec_waits++;
+        // the loss still says the path is congested, the parity only saves
+        // the round trip a retransmit would take
+        congestionLoss();
+    }
+    return 1;
+}
+
+// the input is read through here so the simulator can stand in for the file
+int32 readInput(uint8 *data, int32 len) {
+#ifdef SIMULATION
+    return simReadInput(range_start + sending_position, data, len);
+#endif
+    return fread(data, 1, len, sending_file);
+}
+
+// back in flight, or delivered without being resent
+void clearLost(sent_packet_t *sent) {
+    if(sent->lost) {
+        sent->lost = 0;
+        lost_bytes -= sent->size;
+    }
+}
+
+// gives up on a packet, fillWindow resends it ahead of new data once cwnd
+// has room
+void markLost(uint32 segment) {
+    sent_packet_t *sent = segmentAt(segment);
+    cancelTimer(sent);
+    if(!sent->lost) {
+        sent->lost = 1;
+        lost_bytes += sent->size;
+    }
+    if((int32)(segment - lost_cursor) < 0) {
+        lost_cursor = segment;
+    }
+}
+
+void retransmitPacket(sent_packet_t *sent, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    clearLost(sent);
+    // retransmits aren't held back, but the new data after them is
+    sent->sent_time = pacePacket(HEADER_LENGTH + sent->size);
+    sent->delivered = delivered;
+    sent->delivered_time = delivered_time;
+    if(!sent->retransmitted && !sent->fec_waited) {
+        lost_segments++;
+    }
+    sent->retransmitted = 1;
+    if(retransmit_log_tail - retransmit_log_head == MAX_SEGMENTS_IN_FLIGHT) {
+        // the oldest is left to its timer
+        retransmit_log_head++;
+    }
+    retransmit_entry_t *entry = &retransmit_log[retransmit_log_tail++ % MAX_SEGMENTS_IN_FLIGHT];
+    entry->sent = sent;
+    entry->sequence = sent->sequence;
+    entry->sent_time = sent->sent_time;
+    retransmits++;
+    retransmitted_bytes += sent->size;
+    armTimer(sent, sent->sent_time + rto);
+    header_t resp = {0};
+    resp.type = TYPE_DAT;
+    resp.sequence_number = sent->sequence;
+    resp.ack_number = 0;
+    resp.payload_size = sent->size;
+    resp.window_size = 4096;
+    writeHeader(&resp, buffer, buffer_index);
+    logPacket(&resp, 1);
+    queuePacket(sock, buffer, buffer_index, sent->data, sent->size, sa, sa_size);
+    queued_retransmit = 1;
+}
+
+// resends the lowest packet a timeout gave up on, lost_bytes must not be 0
+void resendLost(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if((int32)(lost_cursor - first_segment) < 0) {
+        lost_cursor = first_segment;
+    }
+    while(!segmentAt(lost_cursor)->lost) {
+        lost_cursor++;
+    }
+    retransmitPacket(segmentAt(lost_cursor), sock, buffer, buffer_index, sa, sa_size);
+}
+
+// returns 1 if a packet was queued
+int32 sendNextDatPacket(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(state != STATE_SENDING) {
+        fprintf(stderr, "Tried to send dat packet when not in sending state\n");
+        return 0;
+    }
+    int32 max_size = sendRoom();
+    if(max_size > segment_size) {
+        max_size = segment_size;
+    }
+    // a short packet would end a FEC block early, so while acks are coming
+    // the window is left to open up for a whole one
+    if(fec_block_size > 0 && max_size < segment_size && segmentsInFlight() > 0) {
+        return 0;
+    }
+    if(max_size <= 0 || segmentsInFlight() == MAX_SEGMENTS_IN_FLIGHT) {
+        return 0;
+    }
+    uint8 *data;
+    int32 len;
+    if(use_mmap) {
+        data = file_map + range_start + sending_position;
+        len = clampToRange(sending_position, file_size - range_start - sending_position < max_size ? file_size - range_start - sending_position : max_size);
+    } else {
+        data = poolAcquire();
+        if(data == NULL) {
+            return 0;
+        }
+        if(use_reader) {
+            len = takeReadAhead(data, max_size);
+            if(len < 0) {
+                // the eventfd wakes us once the reader catches up
+                poolRelease(data);
+                disk_waits++;
+                return 0;
+            }
+        } else {
+            uint64 start = getCurrentTime();
+            len = readInput(data, clampToRange(sending_position, max_size));
+            uint64 elapsed = getCurrentTime() - start;
+            disk_wait_time += elapsed;
+            histogramRecord(&disk_wait_histogram, elapsed / 1000);
+            // anything slower than the page cache counts as waiting on the disk
+            if(elapsed > READ_WAIT_THRESHOLD) {
+                disk_waits++;
+            }
+        }
+    }
+    if(!use_reader) {
+        adviseReadAhead();
+    }
+    if(len == 0) {
+        if(!use_mmap) {
+            poolRelease(data);
+        }
+        fecClose(sock, buffer, buffer_index, sa, sa_size);
+        state = STATE_EOF;
+        if(use_reader) {
+            stopReader();
+        }
+        if(sending_file != NULL) {
+            fclose(sending_file);
+        }
+        LOG(LOG_INFO, "EOF\n");
+        return 0;
+    }
+
+    sent_packet_t *sent = segmentAt(next_segment);
+    sent->sequence = next_seq;
+    sent->file_position = sending_position;
+    sent->size = len;
+    sent->data = data;
+    sent->sent_time = pacePacket(HEADER_LENGTH + len);
+    if(segmentsInFlight() == 0) {
+        delivered_time = sent->sent_time;
+    }
+    sent->delivered = delivered;
+    sent->delivered_time = delivered_time;
+    sent->sacked = 0;
+    sent->retransmitted = 0;
+    sent->fec_block = 0;
+    sent->fec_waited = 0;
+    sent->lost = 0;
+    armTimer(sent, sent->sent_time + rto);
+    next_segment++;
+    sending_position += len;
+    header_t resp = {0};
+    resp.type = TYPE_DAT;
+    resp.sequence_number = next_seq;
+    next_seq += len;
+    histogramRecord(&inflight_histogram, bytesInFlight());
+    resp.ack_number = 0;
+    resp.payload_size = len;
+    resp.window_size = 4096;
+    writeHeader(&resp, buffer, buffer_index);
+    logPacket(&resp, 1);
+    queuePacket(sock, buffer, buffer_index, data, len, sa, sa_size);
+    if(fec_block_size > 0) {
+        fecAdd(sent, sock, buffer, buffer_index, sa, sa_size);
+    }
+    return 1;
+}
+
+void fillWindow(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    pacing_held = 0;
+    // resends are already inside the receiver's window, only cwnd holds them back
+    while(lost_bytes > 0 ? bytesInFlight() < cwnd : state == STATE_SENDING && sendRoom() > 0) {
+        if(pacing_next != 0 && !pacingAllows(getCurrentTime())) {
+            // handleDeadlines carries on once the pacer lets the next one go
+            pacing_held = 1;
+            pacing_waits++;
+            break;
+        }
+        if(lost_bytes > 0) {
+            resendLost(sock, buffer, buffer_index, sa, sa_size);
+            continue;
+        }
+        if(!use_mmap && pool_free_count == 0) {
+            pool_exhausted++;
+            break;
+        }
+        if(!sendNextDatPacket(sock, buffer, buffer_index, sa, sa_size)) {
+            break;
+        }
+    }
+    if(state == STATE_SENDING && sendRoom() <= 0) {
+        network_waits++;
+    }
+}
+
+void sendFin(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    LOG(LOG_INFO, "All packets ack'ed\n");
+    LOG(LOG_INFO, "Retransmitted %llu bytes\n", retransmitted_bytes);
+    if(fec_block_size > 0) {
+        LOG(LOG_INFO, "Sent %llu FEC packets, %llu lost packets waited for them\n", parity_packets, fec_waits);
+    }
+    if(use_mmap) {
+        if(file_map != NULL) {
+            munmap(file_map, file_size);
+        }
+    } else {
+        printPoolStats();
+    }
+    printReadStats();
+    if(probing) {
+        probing = 0;
+        probe_deadline = 0;
+        LOG(LOG_INFO, "Path MTU search cut short at %d\n", plpmtu);
+    }
+    state = STATE_FIN;
+    header_t resp = {0};
+    resp.type = TYPE_FIN;
+    resp.sequence_number = next_seq;
+    // the FIN takes up a sequence number so its ack can't be confused with a
+    // late duplicate ack for the data
+    pending_syn = next_seq + 1;
+    resp.ack_number = 0;
+    resp.payload_size = 0;
+    resp.window_size = 4096;
+    writeHeader(&resp, buffer, buffer_index);
+    logPacket(&resp, 1);
+    flushOut(sock, buffer, buffer_index, sa, sa_size);
+}
+
+void handleTimeout(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(state == STATE_SENDING || state == STATE_EOF) {
+        uint64 now = getCurrentTime();
+        sent_packet_t *expired = expireTimers(now);
+        if(expired == NULL) {
+            return;
+        }
+        // the timer restarts with every ack that delivers something (RFC 6298
+        // 5.3), a packet that has only been waiting behind others that long is
+        // left to SACK to find
+        if(now < delivered_time + rto) {
+            while(expired != NULL) {
+                sent_packet_t *next = expired->timer_next;
+                armTimer(expired, delivered_time + rto);
+                expired = next;
+            }
+            return;
+        }
+        uint32 oldest_segment = nextUnsacked(first_segment);
+        if(oldest_segment == next_segment) {
+            return;
+        }
+        sent_packet_t *oldest = segmentAt(oldest_segment);
+        // every packet has its own timer, but a timeout is one event for the
+        // whole window (RFC 6298 5.4-5.6). Nothing unsacked is left to time
+        // out on its own: the lowest packet is resent now and the rest go
+        // out behind it as the window opens (RFC 5681 3.1)
+        rto_fires++;
+        congestionTimeout();
+        backoffRto();
+        LOG(LOG_EVENT, "Packet %u timed out, rto now %lluus\n", oldest->sequence, rto / 1000);
+        uint32 segment;
+        for(segment = oldest_segment; segment != next_segment; segment = nextUnsacked(segment + 1)) {
+            markLost(segment);
+        }
+        retransmitPacket(oldest, sock, buffer, buffer_index, sa, sa_size);
+    }
+}
+
+// accounts for a packet reaching the receiver, by cumulative ack or SACK. The
+// rtt and delivery rate are sampled from the most recently sent packet
+void packetDelivered(sent_packet_t *sent, ack_sample_t *sample, uint64 now) {
+    delivered += sent->size;
+    sample->acked += sent->size;
+    cancelTimer(sent);
+    if(sample->acked == sent->size || sent->sent_time > sample->sent_time) {
+        sample->sent_time = sent->sent_time;
+        sample->prior_delivered = sent->delivered;
+        sample->prior_time = sent->delivered_time;
+        // Karn: a retransmitted packet's ack could be for either copy
+        sample->rtt = sent->retransmitted ? -1 : (int64)(now - sent->sent_time);
+    }
+    if((!sent->retransmitted || now - sent->sent_time >= min_rtt) && sent->sent_time > newest_delivered_sent) {
+        newest_delivered_sent = sent->sent_time;
+    }
+    // packets are delivered in sequence order here, so one that was only sent
+    // once turning up behind a later one has been reordered on the way
+    if(!sent->retransmitted) {
+        if(sent->sent_time > newest_first_sent) {
+            newest_first_sent = sent->sent_time;
+        } else if(newest_first_sent - sent->sent_time > reorder_extent) {
+            reorder_extent = newest_first_sent - sent->sent_time;
+        }
+    }
+}
+
+// returns how many packets weren't sacked before
+int32 markSacked(sack_block_t *blocks, int32 count, ack_sample_t *sample, uint64 now) {
+    int32 newly_sacked = 0;
+    int32 i;
+    for(i = 0; i < count; i++) {
+        uint32 segment = nextUnsacked(findSegment(blocks[i].start));
+        while(segment != next_segment) {
+            sent_packet_t *sent = segmentAt(segment);
+            if(seqBefore(blocks[i].end, sent->sequence + sent->size)) {
+                break;
+            }
+            sent->sacked = 1;
+            sent->sacked_until = segment + 1;
+            clearLost(sent);
+            sacked_segments++;
+            sacked_bytes += sent->size;
+            if((int32)(segment - hole_cursor) < 0) {
+                sacked_below_cursor++;
+            }
+            packetDelivered(sent, sample, now);
+            newly_sacked++;
+            segment = nextUnsacked(segment + 1);
+        }
+    }
+    return newly_sacked;
+}
+
+// how much later a packet may arrive than one sent after it: a quarter of
+// the rtt, or as far as packets have been seen to be reordered, but never
+// more than a whole rtt (RFC 8985 6.2)
+uint64 reorderWindow() {
+    uint64 window = reorder_extent > min_rtt / 4 ? reorder_extent : min_rtt / 4;
+    return window < srtt ? window : srtt;
+}
+
+// a packet is a hole once DUP_ACK_THRESHOLD packets above it are sacked, or
+// once a packet sent more than reorderWindow() after it has been delivered
+// (RACK, RFC 8985), and is marked lost just once. Both only get truer going
+// down the window, so holes are found by moving hole_cursor forward and
+// never looking behind it
+void markHoles(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if((int32)(hole_cursor - first_segment) < 0) {
+        hole_cursor = first_segment;
+        sacked_below_cursor = 0;
+    }
+    while(hole_cursor != next_segment) {
+        sent_packet_t *sent = segmentAt(hole_cursor);
+        if(sent->sacked) {
+            sacked_below_cursor++;
+        } else if(!sent->lost && !sent->retransmitted) {
+            if(sacked_segments - sacked_below_cursor < DUP_ACK_THRESHOLD && sent->sent_time + reorderWindow() >= newest_delivered_sent) {
+                break;
+            }
+            if(fecMayRebuild(sent, sock, buffer, buffer_index, sa, sa_size)) {
+                // looked at again with the next ack
+                break;
+            }
+            congestionLoss();
+            markLost(hole_cursor);
+        }
+        hole_cursor++;
+    }
+}
+
+// a retransmit is taken as lost too once a packet sent more than
+// reorderWindow() after it has been delivered. The log is in send
+// order, so only its head ever needs looking at
+void markOvertaken() {
+    while(retransmit_log_head != retransmit_log_tail) {
+        retransmit_entry_t entry = retransmit_log[retransmit_log_head % MAX_SEGMENTS_IN_FLIGHT];
+        sent_packet_t *sent = entry.sent;
+        if(seqBefore(entry.sequence, last_acked_seq) || sent->sequence != entry.sequence || sent->sent_time != entry.sent_time || sent->sacked || sent->lost) {
+            // delivered, or sent again since
+            retransmit_log_head++;
+            continue;
+        }
+        if(entry.sent_time + reorderWindow() >= newest_delivered_sent) {
+            break;
+        }
+        retransmit_log_head++;
+        LOG(LOG_EVENT, "Retransmit of %u lost\n", sent->sequence);
+        congestionLoss();
+        markLost(findSegment(sent->sequence));
+    }
+}
+
+// socket buffers start out at the kernel's defaults and only ever grow, to
+// fit the bandwidth delay product as it is measured. The kernel doubles what
+// it is asked for to allow for its overhead per datagram, and unless we may
+// use SO_SNDBUFFORCE and SO_RCVBUFFORCE it holds what we ask for to
+// net.core.wmem_max and rmem_max
+#define MAX_SOCKET_BUFFER (64 * 1024 * 1024)
+// asked for per ack in a round trip, doubled it is about what an ack costs
+#define ACK_BUFFER_COST 512
+
+// what SO_SNDBUF and SO_RCVBUF were last asked for
+int32 send_buffer_size;
+int32 receive_buffer_size;
+uint64 buffers_tuned;
+
+// grows a socket buffer to wanted bytes, *size is what it was last asked for
+void growSocketBuffer(int32 sock, int32 option, int32 force_option, int32 *size, uint64 wanted) {
+#ifdef SIMULATION
+    return;
+#endif
+    if(wanted > MAX_SOCKET_BUFFER) {
+        wanted = MAX_SOCKET_BUFFER;
+    }
+    if(wanted <= *size) {
+        return;
+    }
+    *size = wanted;
+    if(setsockopt(sock, SOL_SOCKET, force_option, size, sizeof *size) != 0) {
+        setsockopt(sock, SOL_SOCKET, option, size, sizeof *size);
+    }
+    int32 actual = 0;
+    socklen_t len = sizeof actual;
+    getsockopt(sock, SOL_SOCKET, option, &actual, &len);
+    LOG(LOG_EVENT, "Socket buffer grown to %d bytes, %llu asked for\n", actual, wanted);
+}
+
+// once a round trip, grows the send buffer to twice the bandwidth delay
+// product, as txtime pacing leaves that much waiting in the qdisc, and the
+// receive buffer to hold an ack for every segment of it
+void tuneSocketBuffers(int32 sock, uint64 delivery_rate) {
+    uint64 now = getCurrentTime();
+    if(srtt == 0 || delivery_rate == 0 || now - buffers_tuned < srtt) {
+        return;
+    }
+    buffers_tuned = now;
+    uint64 bdp = delivery_rate * (srtt / 1000) / 1000000;
+    growSocketBuffer(sock, SO_SNDBUF, SO_SNDBUFFORCE, &send_buffer_size, 2 * bdp);
+    growSocketBuffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, &receive_buffer_size, bdp / segment_size * ACK_BUFFER_COST);
+}
+
+// acks are cumulative: ack_number is the next byte the receiver expects, so
+// every pending packet that ends at or before it has been delivered
+void handleAck(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(queued_retransmit && !use_mmap) {
+        flushQueue(sock);
+    }
+    queued_retransmit = 0;
+    uint64 now = getCurrentTime();
+    ack_sample_t sample = {0, -1, 0, 0, 0, 0};
+    window_size = hdr->window_size;
+    histogramRecord(&window_histogram, window_size);
+    uint32 prior_ack = last_acked_seq;
+    if(seqBefore(hdr->ack_number, last_acked_seq) || seqBefore(next_seq, hdr->ack_number)) {
+        LOG(LOG_EVENT, "Dropping stray ack %u (window %u-%u)\n", hdr->ack_number, last_acked_seq, next_seq);
+        return;
+    } else if(hdr->ack_number != last_acked_seq) {
+        last_acked_seq = hdr->ack_number;
+        duplicate_acks = 0;
+        while(first_segment != next_segment) {
+            sent_packet_t *sent = segmentAt(first_segment);
+            if(seqBefore(last_acked_seq, sent->sequence + sent->size)) {
+                break;
+            }
+            if(sent->sacked) {
+                sacked_segments--;
+                sacked_bytes -= sent->size;
+                if((int32)(first_segment - hole_cursor) < 0) {
+                    sacked_below_cursor--;
+                }
+            } else {
+                clearLost(sent);
+                packetDelivered(sent, &sample, now);
+            }
+            if(!use_mmap) {
+                poolRelease(sent->data);
+            }
+            sent->data = NULL;
+            first_segment++;
+        }
+        LOG(LOG_EVENT, "Packets up to %u acknowledged\n", hdr->ack_number);
+        if(in_recovery && !seqBefore(last_acked_seq, recovery_end)) {
+            in_recovery = 0;
+        }
+    }
+    int32 newly_sacked = 0;
+    if(hdr->type & TYPE_SACK) {
+        sack_block_t blocks[MAX_SACK_BLOCKS];
+        newly_sacked = markSacked(blocks, readSackBlocks(hdr, blocks), &sample, now);
+    }
+    // an ack is only a duplicate if it sacks something new, one that just
+    // moves the window on says nothing about loss
+    if(hdr->ack_number == prior_ack && newly_sacked > 0) {
+        duplicate_ack_count++;
+        if(++duplicate_acks == DUP_ACK_THRESHOLD) {
+            // packet lost
+            uint32 segment = nextUnsacked(first_segment);
+            sent_packet_t *oldest = segmentAt(segment);
+            if(segment != next_segment && !oldest->retransmitted && !oldest->lost && !fecMayRebuild(oldest, sock, buffer, buffer_index, sa, sa_size)) {
+                congestionLoss();
+                markLost(segment);
+            }
+        }
+    }
+    if(sample.rtt >= 0) {
+        updateRtt(sample.rtt);
+    }
+    if(sample.acked > 0) {
+        delivered_time = now;
+        if(now > sample.prior_time) {
+            sample.delivery_rate = (delivered - sample.prior_delivered) * TIME_PER_SECOND / (now - sample.prior_time);
+        }
+        congestion->onAck(&sample);
+        tuneSocketBuffers(sock, sample.delivery_rate);
+    }
+    // a cumulative ack can show a loss too, when what it covers was sent
+    // after a packet above it
+    markOvertaken();
+    markHoles(sock, buffer, buffer_index, sa, sa_size);
+    fillWindow(sock, buffer, buffer_index, sa, sa_size);
+    if(state == STATE_EOF && segmentsInFlight() == 0) {
+        sendFin(sock, buffer, buffer_index, sa, sa_size);
+    }
+}
+
+void startSending(header_t *hdr, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    header_t resp = {0};
+    resp.type = TYPE_ACK;
+    resp.sequence_number = hdr->sequence_number;
+    resp.ack_number = hdr->sequence_number;
+    resp.payload_size = 0;
+    resp.window_size = 4096;
+    writeHeader(&resp, buffer, buffer_index);
+    logPacket(&resp, 1);
+    flushOut(sock, buffer, buffer_index, sa, sa_size);
+    state = STATE_SENDING;
+    next_seq = hdr->sequence_number + 1;
+    last_acked_seq = next_seq;
+    duplicate_acks = 0;
+    in_recovery = 0;
+    delivered = 0;
+    srtt = 0;
+    min_rtt = 0;
+    rttvar = 0;
+    rto = INITIAL_RTO;
+    first_segment = 0;
+    next_segment = 0;
+    sacked_segments = 0;
+    sacked_bytes = 0;
+    hole_cursor = 0;
+    sacked_below_cursor = 0;
+    lost_bytes = 0;
+    lost_cursor = 0;
+    retransmit_log_head = 0;
+    retransmit_log_tail = 0;
+    newest_delivered_sent = 0;
+    newest_first_sent = 0;
+    reorder_extent = 0;
+    wheel_tick = getCurrentTime() / WHEEL_TICK;
+    // enough buffers for a full window of full sized packets, plus spares
+    // for the short ones sent when the window is nearly full. Each one is big
+    // enough for the largest segment probing might settle on
+    if(!use_mmap) {
+        uint32 window = window_size < MAX_SEQUENCE_WINDOW ? window_size : MAX_SEQUENCE_WINDOW;
+        uint32 buffers = (window + segment_size - 1) / segment_size + POOL_SPARE_BUFFERS;
+        poolInit(buffers < MAX_SEGMENTS_IN_FLIGHT ? buffers : MAX_SEGMENTS_IN_FLIGHT, segmentSizeFor(path_mtu));
+    }
+    congestion->init();
+    if(probing) {
+        startProbing(sock, sa, sa_size);
+    }
+    fillWindow(sock, buffer, buffer_index, sa, sa_size);
+    if(state == STATE_EOF && segmentsInFlight() == 0) {
+        sendFin(sock, buffer, buffer_index, sa, sa_size);
+    }
+}
+
+void closeConnection(int32 sock) {
+    flushQueue(sock);
+    printBatchStats(sending_position);
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0 && sending_position > 0) {
+        double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+        LOG(LOG_INFO, "CPU: %.3f s with the %s loop, %.2f s per GB\n", cpu, use_uring ? "io_uring" : "select", cpu * 1000000000.0 / sending_position);
+    }
+    if(gso_sends > 0) {
+        LOG(LOG_INFO, "UDP GSO: %llu packets sent in %llu segmented sends\n", gso_packets, gso_sends);
+    }
+#ifdef SIMULATION
+    simFinished(SIM_SENDER);
+    return;
+#endif
+    close(sock);
+    exit(0);
+}
+
+void readPacket(header_t *hdr, uint8 *payload, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    //printf("Recieved packet type %s sequence %d ack %d payload %d window %d\n", toTypeStr(hdr->type), hdr->sequence_number, hdr->ack_number, hdr->payload_size, hdr->window_size);
+    logPacket(hdr, 0);
+    if(isPrb(hdr)) {
+        if(isAck(hdr)) {
+            probeAcked(hdr, sock, sa, sa_size);
+        }
+        return;
+    }
+    if(state == STATE_SYN) {
+        if(isRst(hdr) && hdr->ack_number == pending_syn) {
+            fprintf(stderr, "Connection refused by the receiver\n");
+            exit(EXIT_FAILURE);
+        }
+        if(isAck(hdr)) {
+            if(hdr->ack_number != pending_syn) {
+                LOG(LOG_EVENT, "Dropping stray ack with seq %u (expecting %u)\n", hdr->ack_number, pending_syn);
+                return;
+            }
+            window_size = hdr->window_size;
+            int32 len;
+            uint8 *ack_delay = findOption(hdr, OPTION_ACK_DELAY, &len);
+            peer_ack_delay = ack_delay != NULL && len >= 4 ? (uint64) getUint32(ack_delay) * 1000 : 0;
+            state = STATE_SYN_RET;
+        }
+        if(isSyn(hdr) && state == STATE_SYN_RET) {
+            startSending(hdr, sock, buffer, buffer_index, sa, sa_size);
+        }
+    } else if(state == STATE_SYN_RET) {
+        if(isSyn(hdr)) {
+            startSending(hdr, sock, buffer, buffer_index, sa, sa_size);
+        }
+    } else if(state == STATE_SENDING || state == STATE_EOF) {
+        if(isAck(hdr)) {
+            handleAck(hdr, payload, sock, buffer, buffer_index, sa, sa_size);
+        }
+    } else if(state == STATE_FIN) {
+        if(isAck(hdr)) {
+            if(pending_syn != hdr->ack_number) {
+                return;
+            }
+            state = STATE_FIN_ACK;
+        }
+        if(isFin(hdr)) {
+            state = STATE_FIN_ACK;
+            header_t resp = {0};
+            resp.type = TYPE_ACK;
+            resp.sequence_number = 0;
+            resp.ack_number = hdr->sequence_number;
+            resp.payload_size = 0;
+            resp.window_size = 4096;
+            writeHeader(&resp, buffer, buffer_index);
+            logPacket(&resp, 1);
+            flushOut(sock, buffer, buffer_index, sa, sa_size);
+        }
+    } else if(state == STATE_FIN_ACK) {
+        if(isAck(hdr)) {
+            if(pending_syn != hdr->ack_number) {
+                return;
+            }
+            closeConnection(sock);
+        }
+        if(isFin(hdr)) {
+            state = STATE_FIN_ACK;
+            header_t resp = {0};
+            resp.type = TYPE_ACK;
+            resp.sequence_number = 0;
+            resp.ack_number = hdr->sequence_number;
+            resp.payload_size = 0;
+            resp.window_size = 4096;
+            writeHeader(&resp, buffer, buffer_index);
+            logPacket(&resp, 1);
+            flushOut(sock, buffer, buffer_index, sa, sa_size);
+            closeConnection(sock);
+        }
+    }
+}
+
+void readDatagram(uint8 *packet, int32 len, int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    LOG(LOG_EVENT, "Received %d\n", len);
+    header_t hdr;
+    int32 payload = readHeader(packet, len, &hdr);
+    if(payload == 0) {
+        LOG(LOG_EVENT, "Dropping malformed packet of %d bytes\n", len);
+        return;
+    }
+    readPacket(&hdr, packet + payload, sock, buffer, buffer_index, sa, sa_size);
+}
+
+// how long the main loop may sleep before a retransmit, probe or paced
+// packet is due, never more than TIMEOUT_USEC
+uint64 nextWait() {
+    uint64 deadline = nextRetransmitTime();
+    if(probe_deadline != 0 && (deadline == 0 || probe_deadline < deadline)) {
+        deadline = probe_deadline;
+    }
+    uint64 paced = pacingDeadline();
+    if(paced != 0 && (deadline == 0 || paced < deadline)) {
+        deadline = paced;
+    }
+    uint64 wait = (uint64) TIMEOUT_USEC * 1000;
+    if(deadline != 0) {
+        uint64 now = getCurrentTime();
+        if(deadline <= now) {
+            wait = 0;
+        } else if(deadline - now < wait) {
+            wait = deadline - now;
+        }
+    }
+    return wait;
+}
+
+void handleDeadlines(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    uint64 deadline = nextRetransmitTime();
+    if(deadline != 0 && deadline <= getCurrentTime()) {
+        handleTimeout(sock, buffer, buffer_index, sa, sa_size);
+    }
+    if(probe_deadline != 0 && probe_deadline <= getCurrentTime()) {
+        handleProbeTimeout(sock, sa, sa_size);
+    }
+    if(pacing_held && pacingAllows(getCurrentTime())) {
+        fillWindow(sock, buffer, buffer_index, sa, sa_size);
+        if(state == STATE_EOF && segmentsInFlight() == 0) {
+            sendFin(sock, buffer, buffer_index, sa, sa_size);
+        }
+    }
+}
+
+// the reader has data that sending may have been waiting for
+void readerWoke(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    if(state != STATE_SENDING) {
+        return;
+    }
+    fillWindow(sock, buffer, buffer_index, sa, sa_size);
+    if(state == STATE_EOF && segmentsInFlight() == 0) {
+        sendFin(sock, buffer, buffer_index, sa, sa_size);
+    }
+}
+
+#ifdef USE_IO_URING
+void runUringLoop(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr_in *sa, socklen_t sa_size) {
+    while(1) {
+        flushQueue(sock);
+        if(!uring_recv_armed) {
+            uringArmRecv(sock);
+        }
+        if(use_reader && state == STATE_SENDING && !uring_wake_armed) {
+            uringArmWake(reader_wake_fd);
+        }
+        if(pending_head == pending_tail) {
+            uint64 wait = nextWait();
+            // a zero timeout means none, so an overdue deadline just polls
+            if(wait > 0) {
+                uringEnter(1, wait);
+            } else {
+                uringEnter(0, 0);
+            }
+            recv_calls++;
+            uringReap();
+        }
+        if(uring_woken) {
+            uring_woken = 0;
+            readerWoke(sock, buffer, buffer_index, (struct sockaddr*)sa, sa_size);
+        }
+        while(pending_head != pending_tail) {
+            uring_completion_t c = pending_recv[pending_head++ % PENDING_RECV_LENGTH];
+            if(c.res < 0) {
+                // out of buffers ends the multishot, it is armed again above
+                if(c.res != -ENOBUFS) {
+                    fprintf(stderr, "io_uring receive failed: %s\n", strerror(-c.res));
+                }
+                continue;
+            }
+            if(!(c.flags & IORING_CQE_F_BUFFER)) {
+                continue;
+            }
+            uint16 bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+            uint8 *buf = uring_buffers + (size_t) bid * URING_BUFFER_LENGTH;
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) buf;
+            uint8 *name = buf + sizeof(struct io_uring_recvmsg_out);
+            uint8 *packet = name + uring_recv_msg.msg_namelen + uring_recv_msg.msg_controllen;
+            received_datagrams++;
+            if(out->namelen >= sizeof(struct sockaddr_in)) {
+                memcpy(sa, name, sizeof(struct sockaddr_in));
+            }
+            readDatagram(packet, out->payloadlen, sock, buffer, buffer_index, (struct sockaddr*)sa, sa_size);
+            uringRecycle(bid);
+        }
+        handleDeadlines(sock, buffer, buffer_index, (struct sockaddr*)sa, sa_size);
+    }
+}
+#endif
+
+// with -k each range of the file is sent by a process of its own, from the
+// next source port up and with -L from the next local address in turn, so
+// the flows can take different paths and each has a congestion window of its
+// own. The receiver only confirms any of them once all of the ranges are in
+int32 flow_count;
+char *local_addrs[MAX_FLOWS];
+int32 local_addr_count;
+uint32 transfer_id;
+int32 flow_index;
+
+// forks a process per flow. Returns in each of them with its range set up,
+// the parent waits for them all and exits. The receiver only confirms a
+// range once all of them are in, so one failed flow stops the rest
+void startFlows(char *path) {
+    pid_t flows[MAX_FLOWS];
+    struct stat st;
+    if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Only a regular file can be split into flows.\n");
+        exit(EXIT_FAILURE);
+    }
+    transfer_id = (uint32) time(NULL) * 2654435761u ^ (uint32) getpid();
+    int64 share = st.st_size / flow_count;
+    fflush(stdout);
+    int32 i;
+    for(i = 0; i < flow_count; i++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Failed to start flow %d: %s\n", i, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        flows[i] = pid;
+        if(pid == 0) {
+            // flows go when the parent does
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            flow_index = i;
+            range_start = share * i;
+            range_length = i == flow_count - 1 ? st.st_size - range_start : share;
+            sender_port += i;
+            if(local_addr_count > 0) {
+                sender_ip = local_addrs[i % local_addr_count];
+            }
+            // -R caps the transfer as a whole
+            rate_cap /= flow_count;
+            LOG(LOG_INFO, "Flow %d sending %lld bytes from offset %lld on %s:%d\n", i, range_length, range_start, sender_ip, sender_port);
+            return;
+        }
+    }
+    int32 failed = 0;
+    int32 status;
+    pid_t pid;
+    while((pid = wait(&status)) > 0 || errno == EINTR) {
+        if(pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            if(failed++ == 0) {
+                for(i = 0; i < flow_count; i++) {
+                    if(flows[i] != pid) {
+                        kill(flows[i], SIGTERM);
+                    }
+                }
+            }
+        }
+    }
+    if(failed > 0) {
+        fprintf(stderr, "%d of %d flows failed\n", failed, flow_count);
+        exit(EXIT_FAILURE);
+    }
+    LOG(LOG_INFO, "All %d flows finished\n", flow_count);
+    exit(0);
+}
+
+// with -j the metrics go to stderr as a JSON line every so many seconds and
+// once more at exit, and with -u a Unix socket hands the same line to anyone
+// who connects, e.g. socat - UNIX-CONNECT:<path>. A thread of its own does
+// both, reading the numbers without locks, so a line can mix values from
+// either side of a packet
+#define METRICS_LINE_LENGTH 4096
+
+int32 metrics_interval;
+char *stats_path;
+int stats_fd = -1;
+uint64 metrics_start;
+pthread_t metrics_thread;
+
+// the numbers behind -j and -u, as one JSON line
+int32 formatMetrics(char *buf, int32 len) {
+    double seconds = (getCurrentTime() - metrics_start) / 1000000000.0;
+    int32 n = snprintf(buf, len, "{\"t\":%.3f,\"flow\":%d,\"state\":%d,\"bytes_sent\":%lld,\"bytes_delivered\":%llu,\"goodput_mbps\":%.3f,"
+        "\"retransmits\":%llu,\"retransmitted_bytes\":%llu,\"rto_fires\":%llu,\"duplicate_acks\":%llu,"
+        "\"cwnd\":%llu,\"bytes_in_flight\":%d,\"srtt_us\":%llu,\"rto_us\":%llu,\"pacing_rate_mbps\":%.3f,\"pacing_waits\":%llu,"
+        "\"parity_packets\":%llu,\"fec_waits\":%llu,\"loss_estimate\":%.4f,\"disk_waits\":%llu,\"disk_wait_ms\":%.1f",
+        seconds, flow_index, state, sending_position, delivered, seconds > 0 ? delivered * 8 / seconds / 1000000 : 0,
+        retransmits, retransmitted_bytes, rto_fires, duplicate_ack_count,
+        (uint64) cwnd, state == STATE_SENDING || state == STATE_EOF ? bytesInFlight() : 0, srtt / 1000, rto / 1000,
+        pacingRate() * 8 / 1000000.0, pacing_waits, parity_packets, fec_waits, fec_loss_rate, disk_waits, disk_wait_time / 1000000.0);
+    n += histogramJson(buf + n, len - n, "rtt_us", &rtt_histogram);
+    n += histogramJson(buf + n, len - n, "in_flight_bytes", &inflight_histogram);
+    n += histogramJson(buf + n, len - n, "window_bytes", &window_histogram);
+    n += histogramJson(buf + n, len - n, "disk_wait_us", &disk_wait_histogram);
+    n += snprintf(buf + n, len - n, "}\n");
+    return n;
+}
+
+void *metricsMain(void *arg) {
+    char line[METRICS_LINE_LENGTH];
+    uint64 next_report = getCurrentTime() + (uint64) metrics_interval * 1000000000;
+    while(1) {
+        int timeout = -1;
+        if(metrics_interval > 0) {
+            uint64 now = getCurrentTime();
+            timeout = next_report > now ? (next_report - now) / 1000000 + 1 : 0;
+        }
+        struct pollfd pfd = {stats_fd, POLLIN, 0};
+        int32 ready = poll(&pfd, stats_fd >= 0 ? 1 : 0, timeout);
+        if(ready > 0 && (pfd.revents & POLLIN)) {
+            int client = accept(stats_fd, NULL, NULL);
+            if(client >= 0) {
+                int32 len = formatMetrics(line, sizeof line);
+                if(write(client, line, len) < 0) {
+                    // the client went away, nothing to do about it
+                }
+                close(client);
+            }
+        }
+        if(metrics_interval > 0 && getCurrentTime() >= next_report) {
+            formatMetrics(line, sizeof line);
+            fputs(line, stderr);
+            next_report += (uint64) metrics_interval * 1000000000;
+        }
+    }
+    return NULL;
+}
+
+void stopMetrics() {
+    if(metrics_interval > 0) {
+        char line[METRICS_LINE_LENGTH];
+        formatMetrics(line, sizeof line);
+        fputs(line, stderr);
+    }
+    if(stats_fd >= 0) {
+        unlink(stats_path);
+    }
+}
+
+void startMetrics(char *path) {
+    metrics_start = getCurrentTime();
+    if(path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if(strlen(path) >= sizeof addr.sun_path) {
+            fprintf(stderr, "Stats socket path %s is too long\n", path);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, path);
+        stats_path = strdup(path);
+        // a socket left behind by an earlier run is in the way
+        unlink(path);
+        stats_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(stats_fd < 0 || bind(stats_fd, (struct sockaddr*) &addr, sizeof addr) != 0 || listen(stats_fd, 16) != 0) {
+            fprintf(stderr, "Can't open the stats socket %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(stats_fd < 0 && metrics_interval == 0) {
+        return;
+    }
+    if(pthread_create(&metrics_thread, NULL, metricsMain, NULL) != 0) {
+        fprintf(stderr, "Failed to start the metrics thread\n");
+        exit(EXIT_FAILURE);
+    }
+    atexit(stopMetrics);
+}
+
+int32 getRandomSequence() {
+    return 100; // Chosen by fair dice roll
+}
+
+void sendSyn(int32 sock, uint8 *buffer, int32 *buffer_index, struct sockaddr*sa, int32 sa_size) {
+    int32 initial_seq = getRandomSequence();
+    pending_syn = initial_seq;
+    header_t hdr = {0};
+    hdr.type = TYPE_SYN;
+    hdr.sequence_number = initial_seq;
+    hdr.ack_number = 0;
+    hdr.payload_size = flow_count > 1 ? FLOW_RANGE_LENGTH : 0;
+    hdr.window_size = 0;
+    writeHeader(&hdr, buffer, buffer_index);
+    if(flow_count > 1) {
+        // tells the receiver where this flow's range goes
+        uint8 *range = buffer + *buffer_index;
+        putUint32(range, transfer_id);
+        putUint32(range + 4, flow_count);
+        putUint32(range + 8, (uint64) range_start >> 32);
+        putUint32(range + 12, range_start);
+        (*buffer_index) += FLOW_RANGE_LENGTH;
+    }
+    logPacket(&hdr, 1);
+    flushOut(sock, buffer, buffer_index, sa, sa_size);
+    state = STATE_SYN;
+}
+
+#ifdef SIMULATION
+// the simulated network has no addresses, this stands in for the receiver's
+struct sockaddr_in sim_peer;
+uint8 sim_buffer[PACKET_BUFFER_LENGTH];
+int32 sim_index;
+
+// sets up what main would for sending size bytes of simulated input, and
+// sends the SYN. Returns 0 for an unknown congestion control
+SIM_EXPORT int32 rdpsSimStart(char *cc, int32 mtu, int64 size, int32 level, int32 paced, uint64 cap, int32 fec_blocks, int32 fec_parity) {
+    log_level = level;
+    pacing = paced ? PACING_TIMER : PACING_OFF;
+    rate_cap = cap;
+    fec_block_size = fec_blocks;
+    fec_fixed_parity = fec_parity;
+    if(fec_block_size > 0) {
+        fecInit();
+    }
+    congestion = findCongestionControl(cc);
+    if(congestion == NULL) {
+        return 0;
+    }
+    batch_size = DEFAULT_BATCH_SIZE;
+    path_mtu = mtu > 0 ? mtu : DEFAULT_PATH_MTU;
+    segment_size = segmentSizeFor(path_mtu);
+    range_length = size;
+    initBatches(batch_size);
+    sendSyn(-1, sim_buffer, &sim_index, (struct sockaddr*) &sim_peer, sizeof sim_peer);
+    flushQueue(-1);
+    return 1;
+}
+
+SIM_EXPORT void rdpsSimReceive(uint8 *packet, int32 len) {
+    readDatagram(packet, len, -1, sim_buffer, &sim_index, (struct sockaddr*) &sim_peer, sizeof sim_peer);
+    flushQueue(-1);
+}
+
+// when the sender has to run next if nothing arrives before then
+SIM_EXPORT uint64 rdpsSimNextWake() {
+    return getCurrentTime() + nextWait();
+}
+
+SIM_EXPORT void rdpsSimWake() {
+    handleDeadlines(-1, sim_buffer, &sim_index, (struct sockaddr*) &sim_peer, sizeof sim_peer);
+    flushQueue(-1);
+}
+
+SIM_EXPORT int32 rdpsSimMetrics(char *buf, int32 len) {
+    return formatMetrics(buf, len);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    congestion = &congestion_controls[0];
+    batch_size = DEFAULT_BATCH_SIZE;
+    path_mtu = 0;
+    char *trace_path = NULL;
+    char *stats_socket = NULL;
+    int32 opt;
+    while((opt = getopt(argc, argv, "b:c:F:gj:k:L:mM:pP:rR:t:u:v:")) != -1) {
+        if(opt == 'c') {
+            congestion = findCongestionControl(optarg);
+            if(congestion == NULL) {
+                fprintf(stderr, "Unknown congestion control %s, expected reno, cubic or bbr.\n", optarg);
+                return 1;
+            }
+        } else if(opt == 'M') {
+            path_mtu = atoi(optarg);
+            if(path_mtu < MIN_PATH_MTU || path_mtu > MAX_PATH_MTU) {
+                fprintf(stderr, "Path MTU must be between %d and %d.\n", MIN_PATH_MTU, MAX_PATH_MTU);
+                return 1;
+            }
+        } else if(opt == 'p') {
+            probing = 1;
+        } else if(opt == 'P') {
+            if(strcmp(optarg, "off") == 0) {
+                pacing = PACING_OFF;
+            } else if(strcmp(optarg, "timer") == 0) {
+                pacing = PACING_TIMER;
+            } else if(strcmp(optarg, "txtime") == 0) {
+                pacing = PACING_TXTIME;
+            } else {
+                fprintf(stderr, "Unknown pacing %s, expected off, timer or txtime.\n", optarg);
+                return 1;
+            }
+        } else if(opt == 'R') {
+            int64 kbit = atoll(optarg);
+            if(kbit < 1) {
+                fprintf(stderr, "Rate cap must be at least 1 kbit/s.\n");
+                return 1;
+            }
+            rate_cap = (uint64) kbit * 1000 / 8;
+        } else if(opt == 'F') {
+            fec_block_size = atoi(optarg);
+            if(fec_block_size < 1 || fec_block_size > FEC_MAX_DATA) {
+                fprintf(stderr, "FEC blocks must be between 1 and %d packets.\n", FEC_MAX_DATA);
+                return 1;
+            }
+            char *parity = strchr(optarg, ',');
+            if(parity != NULL) {
+                fec_fixed_parity = atoi(parity + 1);
+                if(fec_fixed_parity < 0 || fec_fixed_parity > FEC_MAX_PARITY) {
+                    fprintf(stderr, "FEC parity must be between 0 and %d packets.\n", FEC_MAX_PARITY);
+                    return 1;
+                }
+            }
+        } else if(opt == 'r') {
+            use_reader = 1;
+        } else if(opt == 'g') {
+            use_gso = 1;
+        } else if(opt == 'm') {
+            use_mmap = 1;
+        } else if(opt == 'k') {
+            flow_count = atoi(optarg);
+            if(flow_count < 1 || flow_count > MAX_FLOWS) {
+                fprintf(stderr, "Flows must be between 1 and %d.\n", MAX_FLOWS);
+                return 1;
+            }
+        } else if(opt == 'L') {
+            char *addr;
+            for(addr = strtok(optarg, ","); addr != NULL && local_addr_count < MAX_FLOWS; addr = strtok(NULL, ",")) {
+                local_addrs[local_addr_count++] = addr;
+            }
+        } else if(opt == 'v') {
+            log_level = atoi(optarg);
+        } else if(opt == 't') {
+            trace_path = optarg;
+        } else if(opt == 'j') {
+            metrics_interval = atoi(optarg);
+            if(metrics_interval < 1) {
+                fprintf(stderr, "Metrics interval must be at least a second.\n");
+                return 1;
+            }
+        } else if(opt == 'u') {
+            stats_socket = optarg;
+        } else if(opt == 'b') {
+            batch_size = atoi(optarg);
+            if(batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+                fprintf(stderr, "Batch size must be between 1 and %d.\n", MAX_BATCH_SIZE);
+                return 1;
+            }
+        } else {
+            argc = 0;
+        }
+    }
+    if(log_level < LOG_PACKET) {
+        // with nothing printed per packet, lines can go out as they are
+        // written and aren't lost if the process is killed
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    if(argc - optind != 5) {
+        printf("Usage: ./rdps [-b batch] [-c reno|cubic|bbr] [-F packets[,parity]] [-g] [-j seconds] [-k flows [-L addr,...]] [-m] [-M mtu] [-p] [-P off|timer|txtime] [-r] [-R kbit/s] [-t trace_file] [-u stats_socket] [-v level] <sender_ip> <sender_port> <reciever_ip> <reciever_port> <sent_file>\n");
+        return 0;
+    }
+    argv += optind;
+    sender_ip = argv[0];
+    sender_port = atoi(argv[1]);
+    receiver_ip = argv[2];
+    receiver_port = atoi(argv[3]);
+    char *output = argv[4];
+
+    LOG(LOG_INFO, "Starting RDP sender targetting %s:%d and receiving on %s:%d. Sendering file %s\n", receiver_ip, receiver_port, sender_ip, sender_port, output);
+    LOG(LOG_INFO, "Using %s congestion control\n", congestion->name);
+    if(rate_cap != 0) {
+        LOG(LOG_INFO, "Sending at no more than %llu kbit/s\n", rate_cap * 8 / 1000);
+    }
+    if(pacing == PACING_TXTIME && use_gso) {
+        // a segmented send would leave as one burst with one departure time
+        fprintf(stderr, "UDP GSO can't be paced with txtime, sending one datagram per packet\n");
+        use_gso = 0;
+    }
+    if(path_mtu == 0) {
+        // probing has nothing to go on, so it searches as far as it may
+        path_mtu = probing ? MAX_PATH_MTU : DEFAULT_PATH_MTU;
+    }
+    segment_size = segmentSizeFor(probing && path_mtu > BASE_PLPMTU ? BASE_PLPMTU : path_mtu);
+    if(probing) {
+        LOG(LOG_INFO, "Probing for a path MTU of up to %d\n", path_mtu);
+    } else {
+        LOG(LOG_INFO, "Using a path MTU of %d, segments of %d bytes\n", path_mtu, segment_size);
+    }
+    if(fec_block_size > 0) {
+        fecInit();
+        if(fec_fixed_parity >= 0) {
+            LOG(LOG_INFO, "FEC blocks of %d packets with %d parity\n", fec_block_size, fec_fixed_parity);
+        } else {
+            LOG(LOG_INFO, "FEC blocks of %d packets with parity following the loss\n", fec_block_size);
+        }
+    }
+
+    if(flow_count > 1) {
+        startFlows(output);
+    }
+    if(trace_path != NULL) {
+        // each flow traces to a file of its own
+        char path[4096];
+        if(flow_count > 1) {
+            snprintf(path, sizeof path, "%s.%d", trace_path, flow_index);
+        } else {
+            snprintf(path, sizeof path, "%s", trace_path);
+        }
+        startTrace(path, sender_ip, sender_port);
+        trace_remote_addr = inet_addr(receiver_ip);
+    }
+    if(stats_socket != NULL && flow_count > 1) {
+        // and listens on a stats socket of its own
+        char path[4096];
+        snprintf(path, sizeof path, "%s.%d", stats_socket, flow_index);
+        startMetrics(path);
+    } else {
+        startMetrics(stats_socket);
+    }
+    sending_file = fopen(output, "rb");
+    if(!sending_file) {
+        fprintf(stderr, "Output file %s not found.\n", output);
+        return 0;
+    }
+    if(range_start > 0 && fseek(sending_file, range_start, SEEK_SET) != 0) {
+        fprintf(stderr, "Can't seek to offset %lld of %s.\n", range_start, output);
+        return 1;
+    }
+    if(use_mmap) {
+        struct stat st;
+        file_map = NULL;
+        if(fstat(fileno(sending_file), &st) != 0 || !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Can't map %s, falling back to reading it.\n", output);
+            use_mmap = 0;
+        } else if((file_size = st.st_size) > 0) {
+            file_map = (uint8*) mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(sending_file), 0);
+            if(file_map == MAP_FAILED) {
+                fprintf(stderr, "Can't map %s, falling back to reading it: %s\n", output, strerror(errno));
+                use_mmap = 0;
+            } else {
+                madvise(file_map, file_size, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    if(use_mmap) {
+        // pages are touched in place, a reader thread has nothing to do
+        use_reader = 0;
+    } else {
+        posix_fadvise(fileno(sending_file), 0, 0, POSIX_FADV_SEQUENTIAL);
+        if(use_reader) {
+            startReader();
+        }
+    }
+    last_acked_seq = 0;
+    duplicate_acks = 0;
+    retransmitted_bytes = 0;
+    sending_position = 0;
+
+    state = STATE_WAITING;
+
+    int32 s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == -1) {
+        fprintf(stderr, "Failed to create socket\n");
+        fprintf(stderr, "%s\n", strerror(errno));
+        return 1;
+    }
+
+    struct sockaddr_in sa;
+    struct sockaddr_in sout;
+    socklen_t fromlen;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = inet_addr(sender_ip);
+    sa.sin_port = htons(sender_port);
+    fromlen = sizeof(sa);
+
+    memset(&sout, 0, sizeof sout);
+    sout.sin_family = AF_INET;
+    sout.sin_addr.s_addr = inet_addr(receiver_ip);
+    sout.sin_port = htons(receiver_port);
+
+    if (bind(s, (struct sockaddr *)&sa, sizeof sa) == -1) {
+        fprintf(stderr, "Failed to bind port\n");
+        fprintf(stderr, "%s\n", strerror(errno));
+        close(s);
+        return 1;
+    }
+
+    opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+    socklen_t len = sizeof send_buffer_size;
+    getsockopt(s, SOL_SOCKET, SO_SNDBUF, &send_buffer_size, &len);
+    send_buffer_size /= 2;
+    getsockopt(s, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, &len);
+    receive_buffer_size /= 2;
+    if(probing) {
+        // probes have to be dropped rather than fragmented when they are too
+        // big, and the kernel's own path MTU guess must not stop them going out
+        opt = IP_PMTUDISC_PROBE;
+        if(setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &opt, sizeof opt) != 0) {
+            fprintf(stderr, "Can't set the don't fragment bit (%s), not probing\n", strerror(errno));
+            probing = 0;
+            segment_size = segmentSizeFor(DEFAULT_PATH_MTU < path_mtu ? DEFAULT_PATH_MTU : path_mtu);
+        }
+    }
+
+    if(pacing == PACING_TXTIME) {
+        // departure times are in CLOCK_MONOTONIC, which is what fq expects
+        struct sock_txtime txtime = {CLOCK_MONOTONIC, 0};
+        if(setsockopt(s, SOL_SOCKET, SO_TXTIME, &txtime, sizeof txtime) != 0) {
+            fprintf(stderr, "SO_TXTIME not supported (%s), pacing with timers\n", strerror(errno));
+            pacing = PACING_TIMER;
+        }
+    }
+
+    uint8 output_buffer[PACKET_BUFFER_LENGTH];
+    int32 output_index = 0;
+    initBatches(batch_size);
+    if(use_gso) {
+        initGso(s);
+    }
+
+    sendSyn(s, output_buffer, &output_index, (struct sockaddr*)&sout, sizeof sout);
+#ifdef USE_IO_URING
+    use_uring = uringInit(s);
+    if(use_uring) {
+        LOG(LOG_INFO, "Using the io_uring event loop\n");
+        runUringLoop(s, output_buffer, &output_index, &sa, fromlen);
+    }
+#endif
+    fd_set fdset;
+    while (1) {
+        flushQueue(s);
+
+        FD_ZERO(&fdset);
+        FD_SET(s, &fdset);
+        int32 nfds = s + 1;
+        if(use_reader && state == STATE_SENDING) {
+            FD_SET(reader_wake_fd, &fdset);
+            if(reader_wake_fd >= nfds) {
+                nfds = reader_wake_fd + 1;
+            }
+        }
+        uint64 wait = nextWait();
+        struct timeval timeout = {0, wait / 1000};
+        select(nfds, &fdset, NULL, NULL, &timeout);
+
+        if(use_reader && FD_ISSET(reader_wake_fd, &fdset)) {
+            uint64 count;
+            if(read(reader_wake_fd, &count, sizeof count) > 0) {
+                readerWoke(s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen);
+            }
+        }
+
+        if(FD_ISSET(s, &fdset)) {
+            // drain everything that is waiting before going back to select
+            int32 received;
+            do {
+                received = receiveBatch(s, MSG_DONTWAIT);
+                if(received < 0) {
+                    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                        break;
+                    }
+                    fprintf(stderr, "%s\n", strerror(errno));
+                    return 1;
+                }
+                int32 i;
+                for(i = 0; i < received; i++) {
+                    memcpy(&sa, &recv_addrs[i], sizeof sa);
+                    readDatagram(recv_iovs[i].iov_base, recv_msgs[i].msg_len, s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen);
+                }
+            } while(received == batch_size);
         }
+        handleDeadlines(s, output_buffer, &output_index, (struct sockaddr*)&sa, fromlen);
     }
     close(s);
     return 0;
@@ -0,0 +1,432 @@
+// runs rdps and rdpr against each other in one process over a simulated
+// link, on a simulated clock. Nothing touches the network or the disk and
+// time only moves when the next thing is due, so a transfer that would take
+// minutes over rdpl finishes in however long the protocol code takes to run,
+// and a run with the same options and seed is the same run every time.
+// rdps.c and rdpr.c are built for this with -DSIMULATION, which swaps their
+// clock, sockets and files for the sim* functions here
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef unsigned char uint8;
+typedef char int8;
+typedef unsigned short uint16;
+typedef short int16;
+typedef unsigned int uint32;
+typedef int int32;
+typedef unsigned long long uint64;
+typedef long long int64;
+
+#define SIM_SENDER 0
+#define SIM_RECEIVER 1
+#define HEADER_LENGTH 20
+#define DEFAULT_QUEUE_BYTES (256 * 1024)
+#define DEFAULT_LIMIT_SECONDS 600
+// rdpr's defaults
+#define DEFAULT_ACK_EVERY 2
+#define DEFAULT_ACK_DELAY 1000000ULL
+// the input repeats this many bytes, a prime so it never lines up with a
+// segment size and a misplaced segment always shows
+#define PATTERN_LENGTH 65521
+#define METRICS_LENGTH 4096
+
+// the other side of the hooks in rdps.c and rdpr.c
+int32 rdpsSimStart(char *cc, int32 mtu, int64 size, int32 level, int32 paced, uint64 cap, int32 fec_blocks, int32 fec_parity);
+void rdpsSimReceive(uint8 *packet, int32 len);
+uint64 rdpsSimNextWake();
+void rdpsSimWake();
+int32 rdpsSimMetrics(char *buf, int32 len);
+void rdprSimStart(int32 level, int32 every, uint64 delay);
+void rdprSimReceive(uint8 *packet, int32 len);
+uint64 rdprSimNextWake();
+void rdprSimWake();
+int32 rdprSimMetrics(char *buf, int32 len);
+
+// the link, set from the command line with the same options as rdpl
+double loss;
+uint64 delay;
+uint64 jitter;
+double reorder;
+double duplicate;
+// bits per second, 0 for no limit
+uint64 bandwidth;
+uint64 queue_bytes;
+// shorter packets are never lost
+int32 min_loss_size;
+uint64 seed;
+
+typedef struct direction {
+    uint64 random_state;
+    // when the link is done sending what it already has queued
+    uint64 link_free;
+    // release time of the last packet sent in order, jitter never puts a
+    // packet ahead of it
+    uint64 last_release;
+    uint64 received;
+    uint64 dropped;
+    uint64 queue_drops;
+    uint64 duplicated;
+    uint64 reordered;
+} direction_t;
+
+// a packet on its way to an endpoint
+typedef struct event {
+    uint64 time;
+    // keeps packets arriving at the same time in the order they were sent
+    uint64 order;
+    int32 to;
+    uint8 *data;
+    int32 len;
+} event_t;
+
+direction_t directions[2];
+event_t *events;
+int32 event_count;
+int32 event_capacity;
+uint64 event_order;
+uint64 events_run;
+
+uint64 now;
+int64 input_size;
+uint8 pattern[PATTERN_LENGTH];
+// what the receiver has handed over so far, and whether all of it matched
+uint64 delivered;
+uint64 mismatched;
+int32 finished[2];
+uint64 finish_time[2];
+
+uint64 wallTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)(ts.tv_sec) * 1000000000 + (uint64)(ts.tv_nsec);
+}
+
+// xorshift64*, the same streams rdpl uses
+double nextRandom(direction_t *d) {
+    d->random_state ^= d->random_state >> 12;
+    d->random_state ^= d->random_state << 25;
+    d->random_state ^= d->random_state >> 27;
+    return ((d->random_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void seedDirection(direction_t *d, uint64 stream) {
+    memset(d, 0, sizeof(direction_t));
+    // splitmix64 of the seed and stream, never zero
+    uint64 z = seed + stream * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    d->random_state = (z ^ (z >> 31)) | 1;
+}
+
+int32 eventBefore(event_t *a, event_t *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+void eventPush(event_t *e) {
+    if(event_count == event_capacity) {
+        event_capacity = event_capacity == 0 ? 1024 : event_capacity * 2;
+        events = (event_t*) realloc(events, event_capacity * sizeof(event_t));
+        if(events == NULL) {
+            fprintf(stderr, "Failed to allocate the event queue\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int32 i = event_count++;
+    events[i] = *e;
+    while(i > 0 && eventBefore(&events[i], &events[(i - 1) / 2])) {
+        event_t tmp = events[i];
+        events[i] = events[(i - 1) / 2];
+        events[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+void eventPop() {
+    events[0] = events[--event_count];
+    int32 i = 0;
+    while(1) {
+        int32 smallest = i;
+        int32 left = 2 * i + 1;
+        int32 right = 2 * i + 2;
+        if(left < event_count && eventBefore(&events[left], &events[smallest])) {
+            smallest = left;
+        }
+        if(right < event_count && eventBefore(&events[right], &events[smallest])) {
+            smallest = right;
+        }
+        if(smallest == i) {
+            break;
+        }
+        event_t tmp = events[i];
+        events[i] = events[smallest];
+        events[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// works out when a packet comes out of the far end of the link, as rdpl does
+void schedule(direction_t *d, int32 to, uint8 *data, int32 len) {
+    uint64 sent = now;
+    if(bandwidth > 0) {
+        uint64 start = d->link_free > now ? d->link_free : now;
+        if((start - now) * bandwidth / 8000000000ULL > queue_bytes) {
+            d->queue_drops++;
+            return;
+        }
+        d->link_free = start + (uint64) len * 8000000000ULL / bandwidth;
+        sent = d->link_free;
+    }
+    uint64 release = sent + delay;
+    if(jitter > 0) {
+        int64 offset = (int64)(nextRandom(d) * (2 * jitter + 1)) - (int64) jitter;
+        release = offset < 0 && (uint64)(-offset) > release ? 0 : release + offset;
+    }
+    if(reorder > 0 && nextRandom(d) < reorder) {
+        release = sent;
+        d->reordered++;
+    } else {
+        if(release < d->last_release) {
+            release = d->last_release;
+        }
+        d->last_release = release;
+    }
+    event_t e;
+    e.time = release < now ? now : release;
+    e.order = event_order++;
+    e.to = to;
+    e.len = len;
+    e.data = (uint8*) malloc(len);
+    if(e.data == NULL) {
+        fprintf(stderr, "Failed to allocate a simulated packet\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(e.data, data, len);
+    eventPush(&e);
+}
+
+uint64 simNow() {
+    return now;
+}
+
+// takes a batch the way sendmmsg would, every message one packet on the link
+int32 simSendBatch(int32 from, struct mmsghdr *msgs, int32 count) {
+    direction_t *d = &directions[from];
+    int32 to = from == SIM_SENDER ? SIM_RECEIVER : SIM_SENDER;
+    uint8 packet[65535 + 256];
+    int32 i;
+    for(i = 0; i < count; i++) {
+        int32 len = 0;
+        size_t j;
+        for(j = 0; j < msgs[i].msg_hdr.msg_iovlen; j++) {
+            struct iovec *iov = &msgs[i].msg_hdr.msg_iov[j];
+            memcpy(packet + len, iov->iov_base, iov->iov_len);
+            len += iov->iov_len;
+        }
+        msgs[i].msg_len = len;
+        d->received++;
+        if(len >= min_loss_size && loss > 0 && nextRandom(d) < loss) {
+            d->dropped++;
+            continue;
+        }
+        schedule(d, to, packet, len);
+        if(duplicate > 0 && nextRandom(d) < duplicate) {
+            d->duplicated++;
+            schedule(d, to, packet, len);
+        }
+    }
+    return count;
+}
+
+// the input is the pattern over and over, so it never has to be kept
+int32 simReadInput(int64 offset, uint8 *data, int32 len) {
+    if(offset >= input_size) {
+        return 0;
+    }
+    if(len > input_size - offset) {
+        len = input_size - offset;
+    }
+    int32 i;
+    for(i = 0; i < len; i++) {
+        data[i] = pattern[(offset + i) % PATTERN_LENGTH];
+    }
+    return len;
+}
+
+void simDeliverData(uint64 offset, uint8 *data, int32 len) {
+    if(offset != delivered) {
+        // the receiver only hands over data in order
+        mismatched += len;
+    } else {
+        int32 i;
+        for(i = 0; i < len; i++) {
+            if(data[i] != pattern[(offset + i) % PATTERN_LENGTH]) {
+                mismatched++;
+            }
+        }
+    }
+    delivered += len;
+}
+
+void simFinished(int32 endpoint) {
+    if(!finished[endpoint]) {
+        finished[endpoint] = 1;
+        finish_time[endpoint] = now;
+    }
+}
+
+void printDirection(char *name, direction_t *d) {
+    printf("  %s: %llu sent, %llu lost, %llu dropped by the queue, %llu duplicated, %llu reordered\n",
+        name, d->received, d->dropped, d->queue_drops, d->duplicated, d->reordered);
+}
+
+int main(int argc, char *argv[]) {
+    queue_bytes = DEFAULT_QUEUE_BYTES;
+    min_loss_size = HEADER_LENGTH + 1;
+    seed = 1;
+    char *cc = "reno";
+    int32 mtu = 0;
+    int32 level = 0;
+    uint64 limit = (uint64) DEFAULT_LIMIT_SECONDS * 1000000000;
+    int32 ack_every = DEFAULT_ACK_EVERY;
+    uint64 ack_delay = DEFAULT_ACK_DELAY;
+    int32 paced = 1;
+    uint64 cap = 0;
+    int32 fec_blocks = 0;
+    int32 fec_parity = -1;
+    int32 opt;
+    while((opt = getopt(argc, argv, "a:b:c:d:D:F:j:l:m:M:P:q:r:R:s:T:v:")) != -1) {
+        if(opt == 'a') {
+            ack_every = atoi(optarg);
+            char *delay = strchr(optarg, ',');
+            if(delay != NULL) {
+                ack_delay = atof(delay + 1) * 1000000;
+            }
+        } else if(opt == 'l') {
+            loss = atof(optarg);
+        } else if(opt == 'd') {
+            delay = atof(optarg) * 1000000;
+        } else if(opt == 'j') {
+            jitter = atof(optarg) * 1000000;
+        } else if(opt == 'r') {
+            reorder = atof(optarg);
+        } else if(opt == 'D') {
+            duplicate = atof(optarg);
+        } else if(opt == 'b') {
+            bandwidth = atof(optarg) * 1000;
+        } else if(opt == 'q') {
+            queue_bytes = atoll(optarg);
+        } else if(opt == 'm') {
+            min_loss_size = atoi(optarg);
+        } else if(opt == 's') {
+            seed = strtoull(optarg, NULL, 10);
+        } else if(opt == 'c') {
+            cc = optarg;
+        } else if(opt == 'M') {
+            mtu = atoi(optarg);
+        } else if(opt == 'P') {
+            // txtime needs a real socket, so only the timer pacer runs here
+            paced = strcmp(optarg, "off") != 0;
+        } else if(opt == 'R') {
+            cap = atoll(optarg) * 1000 / 8;
+        } else if(opt == 'F') {
+            fec_blocks = atoi(optarg);
+            char *parity = strchr(optarg, ',');
+            if(parity != NULL) {
+                fec_parity = atoi(parity + 1);
+            }
+        } else if(opt == 'T') {
+            limit = atof(optarg) * 1000000000;
+        } else if(opt == 'v') {
+            level = atoi(optarg);
+        } else {
+            argc = 0;
+        }
+    }
+    if(argc - optind != 1) {
+        printf("Usage: ./rdpsim [-l loss] [-d delay_ms] [-j jitter_ms] [-r reorder] [-D duplicate] [-b kbit/s [-q queue_bytes]] [-m min_loss_size] [-s seed] [-a segments[,delay_ms]] [-c reno|cubic|bbr] [-F packets[,parity]] [-M mtu] [-P off|timer] [-R kbit/s] [-T seconds] [-v level] <bytes>\n");
+        return 0;
+    }
+    input_size = atoll(argv[optind]);
+    seedDirection(&directions[SIM_SENDER], 0);
+    seedDirection(&directions[SIM_RECEIVER], 1);
+    direction_t pattern_stream;
+    seedDirection(&pattern_stream, 2);
+    int32 i;
+    for(i = 0; i < PATTERN_LENGTH; i++) {
+        pattern[i] = nextRandom(&pattern_stream) * 256;
+    }
+
+    uint64 wall_start = wallTime();
+    if(ack_every < 1 || ack_delay < 1000) {
+        fprintf(stderr, "Acks must be every segment or more, with a delay of at least 0.001ms.\n");
+        return 1;
+    }
+    if(fec_blocks < 0 || fec_blocks > 32 || fec_parity > 4) {
+        fprintf(stderr, "FEC blocks must be up to 32 packets with up to 4 parity.\n");
+        return 1;
+    }
+    rdprSimStart(level, ack_every, ack_delay);
+    if(!rdpsSimStart(cc, mtu, input_size, level, paced, cap, fec_blocks, fec_parity)) {
+        fprintf(stderr, "Unknown congestion control %s, expected reno, cubic or bbr.\n", cc);
+        return 1;
+    }
+    while(!(finished[SIM_SENDER] && finished[SIM_RECEIVER]) && now <= limit) {
+        // whichever endpoint has the earlier timer, 0 when neither has one
+        int32 waking = SIM_SENDER;
+        uint64 wake = finished[SIM_SENDER] ? 0 : rdpsSimNextWake();
+        uint64 receiver_wake = finished[SIM_RECEIVER] ? 0 : rdprSimNextWake();
+        if(receiver_wake != 0 && (wake == 0 || receiver_wake < wake)) {
+            waking = SIM_RECEIVER;
+            wake = receiver_wake;
+        }
+        if(event_count > 0 && (wake == 0 || events[0].time <= wake)) {
+            event_t e = events[0];
+            eventPop();
+            now = e.time;
+            if(!finished[e.to]) {
+                if(e.to == SIM_SENDER) {
+                    rdpsSimReceive(e.data, e.len);
+                } else {
+                    rdprSimReceive(e.data, e.len);
+                }
+            }
+            free(e.data);
+        } else if(wake != 0) {
+            now = wake < now ? now : wake;
+            if(waking == SIM_SENDER) {
+                rdpsSimWake();
+            } else {
+                rdprSimWake();
+            }
+        } else {
+            // nothing on the link and nobody waiting on a timer
+            break;
+        }
+        events_run++;
+    }
+    double wall = (wallTime() - wall_start) / 1e9;
+
+    int32 complete = finished[SIM_SENDER] && finished[SIM_RECEIVER];
+    int32 verified = complete && delivered == (uint64) input_size && mismatched == 0;
+    double seconds = (complete ? finish_time[SIM_RECEIVER] : now) / 1e9;
+    printf("%s %lld bytes in %.3f simulated seconds, %.3f seconds of wall time, %llu events, %.3f Mbit/s\n",
+        complete ? "Sent" : "Gave up on", input_size, seconds, wall, events_run, seconds > 0 ? delivered * 8 / seconds / 1000000 : 0);
+    printf("Delivered %llu bytes, %llu did not match the input: %s\n", delivered, mismatched, verified ? "verified" : "FAILED");
+    printDirection("sender to receiver", &directions[SIM_SENDER]);
+    printDirection("receiver to sender", &directions[SIM_RECEIVER]);
+    char metrics[METRICS_LENGTH];
+    if(rdpsSimMetrics(metrics, sizeof metrics) > 0) {
+        printf("%s", metrics);
+    }
+    if(rdprSimMetrics(metrics, sizeof metrics) > 0) {
+        printf("%s", metrics);
+    }
+    return verified ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+
+
+// decodes the binary packet traces rdps and rdpr write with -t into the
+// same lines they print for every packet with -v 3
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned char uint8;
+typedef char int8;
+typedef unsigned short uint16;
+typedef short int16;
+typedef unsigned int uint32;
+typedef int int32;
+typedef unsigned long long uint64;
+typedef long long int64;
+
+#define TYPE_DAT 1
+#define TYPE_ACK 2
+#define TYPE_SYN 4
+#define TYPE_FIN 8
+#define TYPE_RST 16
+#define TYPE_SACK 32
+#define TYPE_PRB 64
+#define TYPE_FEC 128
+
+#define TRACE_MAGIC 0x54504452
+#define TRACE_VERSION 2
+
+typedef struct trace_file_header {
+    uint32 magic;
+    uint32 version;
+    // the two clocks read together, so record times map to the wall clock
+    uint64 realtime_base;
+    uint64 monotonic_base;
+} trace_file_header_t;
+
+typedef struct trace_record {
+    // CLOCK_MONOTONIC ns
+    uint64 time;
+    // addresses in network order, ports in host order
+    uint32 local_addr;
+    uint32 remote_addr;
+    uint32 sequence_number;
+    uint32 ack_number;
+    uint32 window_size;
+    uint16 local_port;
+    uint16 remote_port;
+    uint16 payload_size;
+    uint8 sent;
+    uint8 type;
+    uint32 reserved;
+} trace_record_t;
+
+char *toTypeStr(uint8 type) {
+    if(type == TYPE_ACK) {
+        return "ACK";
+    } else if(type == (TYPE_SYN | TYPE_ACK)) {
+        return "SYN/ACK";
+    } else if(type == TYPE_SYN) {
+        return "SYN";
+    } else if(type == TYPE_DAT) {
+        return "DAT";
+    } else if(type == TYPE_FIN) {
+        return "FIN";
+    } else if(type == (TYPE_ACK | TYPE_SACK)) {
+        return "SACK";
+    } else if(type == TYPE_PRB) {
+        return "PRB";
+    } else if(type == (TYPE_ACK | TYPE_PRB)) {
+        return "PRB/ACK";
+    } else if(type == TYPE_FEC) {
+        return "FEC";
+    }
+    return "UNK";
+}
+
+void printRecord(trace_file_header_t *header, trace_record_t *r) {
+    char buf[150];
+    time_t curtime = (header->realtime_base + (int64)(r->time - header->monotonic_base)) / 1000000000;
+    struct tm *loc_time = localtime(&curtime);
+    strftime(buf, 150, "%T", loc_time);
+
+    char s = r->sent ? 's' : 'r';
+    uint32 seqno = (r->type & TYPE_ACK) ? r->ack_number : r->sequence_number;
+    uint32 length = (r->type & (TYPE_DAT | TYPE_FEC)) ? r->payload_size : r->window_size;
+
+    // inet_ntoa's buffer is reused, so the addresses are copied out one at a time
+    char local[INET_ADDRSTRLEN];
+    char remote[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = r->local_addr;
+    snprintf(local, sizeof local, "%s", inet_ntoa(addr));
+    addr.s_addr = r->remote_addr;
+    snprintf(remote, sizeof remote, "%s", inet_ntoa(addr));
+
+    printf("%s %c %s:%d %s:%d %s %u %u\n", buf, s, local, r->local_port, remote, r->remote_port, toTypeStr(r->type), seqno, length);
+}
+
+int32 decodeTrace(char *path) {
+    FILE *file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "Trace file %s not found.\n", path);
+        return 1;
+    }
+    trace_file_header_t header;
+    if(fread(&header, sizeof header, 1, file) != 1 || header.magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s is not a packet trace.\n", path);
+        fclose(file);
+        return 1;
+    }
+    if(header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is a version %u trace, expected version %d.\n", path, header.version, TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+    trace_record_t records[1024];
+    size_t count;
+    while((count = fread(records, sizeof(trace_record_t), 1024, file)) > 0) {
+        size_t i;
+        for(i = 0; i < count; i++) {
+            printRecord(&header, &records[i]);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        printf("Usage: ./rdpt <trace_file> [<trace_file> ...]\n");
+        return 0;
+    }
+    int32 failed = 0;
+    int32 i;
+    for(i = 1; i < argc; i++) {
+        failed |= decodeTrace(argv[i]);
+    }
+    return failed;
+}